@@ -0,0 +1,211 @@
+// 热点函数的微基准（Google Benchmark），直接包含server.cpp测试其内部函数
+// 编译：g++ -O2 bench.cpp -o bench -ljsoncpp -lbenchmark -pthread
+// 运行：./bench --benchmark_repetitions=10 --benchmark_report_aggregates_only=true
+#define GATEWAY_NO_MAIN
+#include "server.cpp"
+
+#include <benchmark/benchmark.h>
+
+const std::string UPLOAD_FRAME = R"({"command":"upload","device_id":"sensor_001","data":{"temperature":25.6,"soil_moisture":43.2,"temp_threshold":30.0,"moisture_threshold":40.0,"watering":false}})";
+const std::string GET_DATA_FRAME = R"({"command":"get_data","device_id":"sensor_001"})";
+const std::string SET_THRESHOLD_FRAME = R"({"command":"set_threshold","device_id":"sensor_001","temp_threshold":31.0,"moisture_threshold":41.0,"request_id":"pc-42"})";
+const DeviceData SAMPLE_DATA{25.6, 43.2, 30.0, 40.0, false};
+
+std::vector<std::string> make_device_ids(size_t count) {
+    std::vector<std::string> ids;
+    for (size_t i = 0; i < count; ++i) {
+        ids.push_back("sensor_" + std::to_string(i));
+    }
+    return ids;
+}
+
+// ---- 编码 ----
+
+void BM_CreateAck(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(create_ack("sensor_001", "success"));
+    }
+}
+BENCHMARK(BM_CreateAck);
+
+void BM_CreateAckWithRequestId(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(create_ack("sensor_001", "success", "pc-42"));
+    }
+}
+BENCHMARK(BM_CreateAckWithRequestId);
+
+void BM_RenderDataResponse(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(render_data_response("sensor_001", SAMPLE_DATA));
+    }
+}
+BENCHMARK(BM_RenderDataResponse);
+
+void BM_CreateUpdateThreshold(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(create_update_threshold("sensor_001", 31.0, 41.0, "17"));
+    }
+}
+BENCHMARK(BM_CreateUpdateThreshold);
+
+void BM_BinaryAck(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(binary_ack("sensor_001", "success", "pc-42"));
+    }
+}
+BENCHMARK(BM_BinaryAck);
+
+void BM_BinaryDataResponse(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(binary_data_response("sensor_001", SAMPLE_DATA));
+    }
+}
+BENCHMARK(BM_BinaryDataResponse);
+
+// ---- 解码 ----
+
+void decode_fast_path(benchmark::State& state, const std::string& frame) {
+    Message msg;
+    for (auto _ : state) {
+        bool ok = decode_message(frame, msg);
+        benchmark::DoNotOptimize(ok);
+        benchmark::DoNotOptimize(msg.data);
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+}
+BENCHMARK_CAPTURE(decode_fast_path, upload, UPLOAD_FRAME);
+BENCHMARK_CAPTURE(decode_fast_path, get_data, GET_DATA_FRAME);
+BENCHMARK_CAPTURE(decode_fast_path, set_threshold, SET_THRESHOLD_FRAME);
+
+void decode_jsoncpp(benchmark::State& state, const std::string& frame) {
+    Message msg;
+    for (auto _ : state) {
+        JsonFallback storage;
+        bool ok = decode_message_jsoncpp(frame, msg, storage);
+        benchmark::DoNotOptimize(ok);
+        benchmark::DoNotOptimize(msg.data);
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+}
+BENCHMARK_CAPTURE(decode_jsoncpp, upload, UPLOAD_FRAME);
+BENCHMARK_CAPTURE(decode_jsoncpp, set_threshold, SET_THRESHOLD_FRAME);
+
+void BM_DecodeBinaryUpload(benchmark::State& state) {
+    std::string frame(1, (char)BIN_UPLOAD);
+    append_binary_string(frame, "sensor_001");
+    frame.resize(frame.size() + DEVICE_DATA_BYTES);
+    pack_device_data(&frame[frame.size() - DEVICE_DATA_BYTES], SAMPLE_DATA);
+    Message msg;
+    for (auto _ : state) {
+        bool ok = decode_binary_message(frame, msg);
+        benchmark::DoNotOptimize(ok);
+        benchmark::DoNotOptimize(msg.data);
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+}
+BENCHMARK(BM_DecodeBinaryUpload);
+
+// 按行分帧：一次切出range(0)条上报
+void BM_FrameExtractNewline(benchmark::State& state) {
+    std::string stream;
+    for (int i = 0; i < state.range(0); ++i) {
+        stream += UPLOAD_FRAME;
+        stream += '\n';
+    }
+    for (auto _ : state) {
+        FrameParser parser;
+        size_t frames = 0;
+        parser.extract(stream.data(), stream.size(), [&](std::string_view) { ++frames; });
+        benchmark::DoNotOptimize(frames);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * stream.size());
+}
+BENCHMARK(BM_FrameExtractNewline)->Arg(64);
+
+// ---- 设备表 ----
+
+// 向空表插入range(0)个新设备（含首个历史采样）
+void BM_StoreInsert(benchmark::State& state) {
+    std::vector<std::string> ids = make_device_ids(state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto store = std::make_unique<DeviceStore>();
+        state.ResumeTiming();
+        for (const auto& id : ids) {
+            store->upload(id, SAMPLE_DATA);
+        }
+        state.PauseTiming();
+        store.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_StoreInsert)->Arg(1024)->Arg(16384);
+
+// 预先放入1024个设备的表，多线程基准共用
+DeviceStore& populated_store() {
+    static DeviceStore* store = [] {
+        auto* populated = new DeviceStore();
+        for (const auto& id : make_device_ids(1024)) {
+            populated->upload(id, SAMPLE_DATA);
+        }
+        return populated;
+    }();
+    return *store;
+}
+
+// 已有设备的上报：更新数据、使缓存失效并追加历史
+void BM_StoreUpload(benchmark::State& state) {
+    DeviceStore& store = populated_store();
+    std::vector<std::string> ids = make_device_ids(1024);
+    size_t i = state.thread_index();
+    for (auto _ : state) {
+        store.upload(ids[i++ % ids.size()], SAMPLE_DATA);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_StoreUpload)->ThreadRange(1, 8)->UseRealTime();
+
+// get_data的查表：缓存命中时只需读锁和一次原子读取
+void BM_StoreLookup(benchmark::State& state) {
+    DeviceStore& store = populated_store();
+    std::vector<std::string> ids = make_device_ids(1024);
+    size_t i = state.thread_index();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(store.data_response(ids[i++ % ids.size()]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_StoreLookup)->ThreadRange(1, 8)->UseRealTime();
+
+// 64个采样分属16个设备的upload_batch
+void BM_StoreUploadBatch(benchmark::State& state) {
+    DeviceStore& store = populated_store();
+    std::vector<std::string> ids = make_device_ids(16);
+    std::vector<BatchSample> samples(64);
+    for (size_t i = 0; i < samples.size(); ++i) {
+        samples[i].device_id = ids[i % ids.size()];
+        samples[i].data = SAMPLE_DATA;
+    }
+    std::vector<std::string_view> updated;
+    for (auto _ : state) {
+        updated.clear();
+        store.upload_batch(samples, now_ms(), updated);
+    }
+    state.SetItemsProcessed(state.iterations() * samples.size());
+}
+BENCHMARK(BM_StoreUploadBatch);
+
+int main(int argc, char** argv) {
+    // 被测函数中的日志不计入
+    log_level = LOG_ERROR;
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,584 @@
+// 网关压测工具：模拟大量STM32设备和PC监控端，统计吞吐和延迟
+// 编译：g++ -O2 loadgen.cpp -o loadgen -pthread
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <chrono>
+
+#define DEFAULT_PORT 7878
+#define BUFFER_SIZE 65536
+#define MAX_EVENTS 256
+#define REPORT_INTERVAL_MS 1000
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = DEFAULT_PORT;
+    unsigned devices = 1000;
+    unsigned pcs = 10;
+    double upload_rate = 1;          // 每个设备每秒上报次数
+    double request_rate = 10;        // 每个PC每秒请求次数
+    double threshold_ratio = 0.1;    // PC请求中set_threshold所占比例，其余为get_data
+    unsigned threads = 4;
+    unsigned duration = 10;          // 秒
+    std::string prefix = "lg_";      // 模拟设备的device_id前缀
+};
+
+const auto start_time = std::chrono::steady_clock::now();
+
+// 相对于启动时刻的微秒数，同时写进上报的temperature，订阅者收到推送时据此计算推送延迟
+uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+// 对数分桶的延迟直方图（微秒）：每个2的幂区间再等分成32格，相对误差约3%
+class LatencyHistogram {
+public:
+    void record(uint64_t us) {
+        ++counts[bucket(us)];
+        ++total;
+        max = std::max(max, us);
+    }
+    
+    void merge(const LatencyHistogram& other) {
+        for (unsigned i = 0; i < BUCKETS; ++i) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+    
+    // 第q分位所在桶的上界
+    uint64_t percentile(double q) const {
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)std::ceil(q * total));
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= target) {
+                return std::min(bucket_max(i), max);
+            }
+        }
+        return max;
+    }
+    
+    uint64_t count() const { return total; }
+    uint64_t maximum() const { return max; }
+    
+private:
+    static constexpr unsigned SUB_BITS = 5;
+    static constexpr unsigned BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+    
+    static unsigned bucket(uint64_t v) {
+        if (v < (1u << SUB_BITS)) {
+            return v;
+        }
+        unsigned shift = 63 - __builtin_clzll(v) - SUB_BITS;
+        return ((shift + 1) << SUB_BITS) + ((v >> shift) & ((1u << SUB_BITS) - 1));
+    }
+    
+    static uint64_t bucket_max(unsigned b) {
+        if (b < (1u << SUB_BITS)) {
+            return b;
+        }
+        unsigned shift = (b >> SUB_BITS) - 1;
+        uint64_t mantissa = (b & ((1u << SUB_BITS) - 1)) | (1u << SUB_BITS);
+        return ((mantissa + 1) << shift) - 1;
+    }
+    
+    std::vector<uint64_t> counts = std::vector<uint64_t>(BUCKETS);
+    uint64_t total = 0;
+    uint64_t max = 0;
+};
+
+// 各线程的计数，主线程每秒读取一次输出速率
+struct Counters {
+    std::atomic<uint64_t> uploads{0};
+    std::atomic<uint64_t> upload_acks{0};
+    std::atomic<uint64_t> gets{0};
+    std::atomic<uint64_t> get_responses{0};
+    std::atomic<uint64_t> thresholds{0};
+    std::atomic<uint64_t> threshold_acks{0};
+    std::atomic<uint64_t> threshold_failures{0};  // 回复不是success（设备未连接、超时等）
+    std::atomic<uint64_t> pushes{0};
+    std::atomic<uint64_t> errors{0};              // 连接被服务器断开
+};
+
+struct Client {
+    int fd = -1;
+    uint32_t index = 0;                       // 在所属Worker中的下标，也是epoll事件携带的数据
+    bool device = false;
+    std::string device_id;                    // 设备连接上报用的ID
+    std::string inbuf;
+    std::string outbuf;                       // 内核发送缓冲区满时暂存
+    bool want_write = false;
+    uint64_t interval = 0;                    // 发送间隔（微秒）
+    std::deque<uint64_t> uploads;             // 未确认上报的计划发送时间，服务器按顺序回复
+    std::unordered_map<std::string, std::deque<uint64_t>> gets; // device_id -> 未回复get_data的计划发送时间
+    std::unordered_map<std::string, uint64_t> thresholds;       // request_id -> 计划发送时间
+};
+
+// 取出紧凑JSON中某个字段的值：字符串去掉引号，其余取到','或'}'为止。服务器回复由jsoncpp生成，不含多余空白
+std::string_view json_field(std::string_view line, std::string_view key) {
+    size_t pos = line.find(key);
+    if (pos == std::string_view::npos) {
+        return {};
+    }
+    pos += key.size();
+    if (pos < line.size() && line[pos] == '"') {
+        size_t end = line.find('"', pos + 1);
+        return end == std::string_view::npos ? std::string_view() : line.substr(pos + 1, end - pos - 1);
+    }
+    size_t end = line.find_first_of(",}", pos);
+    return line.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+}
+
+// 每个线程用一个epoll管理分给它的连接，按各连接的计划时间发送请求
+class Worker {
+public:
+    Counters counters;
+    LatencyHistogram upload_latency;
+    LatencyHistogram get_latency;
+    LatencyHistogram threshold_latency;
+    LatencyHistogram push_latency;
+    
+    Worker(const Options& options, unsigned seed) : opts(options), rng(seed) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    
+    ~Worker() {
+        for (auto& client : clients) {
+            if (client->fd >= 0) {
+                close(client->fd);
+            }
+        }
+        close(epoll_fd);
+    }
+    
+    void add(int fd, bool device, std::string device_id, double rate) {
+        auto client = std::make_unique<Client>();
+        client->fd = fd;
+        client->index = clients.size();
+        client->device = device;
+        client->device_id = std::move(device_id);
+        client->interval = std::max<uint64_t>(1, (uint64_t)(1e6 / rate));
+        
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u32 = client->index;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        clients.push_back(std::move(client));
+    }
+    
+    void run(uint64_t deadline) {
+        // 首次发送时间在一个间隔内随机错开，避免所有连接同时发送；从开始运行算起，建连耗时不计入
+        uint64_t start = now_us();
+        for (const auto& client : clients) {
+            schedule.emplace(start + std::uniform_int_distribution<uint64_t>(0, client->interval)(rng), client->index);
+        }
+        
+        epoll_event events[MAX_EVENTS];
+        char buffer[BUFFER_SIZE];
+        while (true) {
+            uint64_t now = now_us();
+            if (now >= deadline) {
+                break;
+            }
+            // 发送所有到期的请求；延迟从计划时间算起，压测端自身落后时不会低估延迟
+            while (!schedule.empty() && schedule.top().first <= now) {
+                auto [due, index] = schedule.top();
+                schedule.pop();
+                Client& client = *clients[index];
+                if (client.fd < 0) {
+                    continue;
+                }
+                if (client.device) {
+                    send_upload(client, due);
+                } else {
+                    send_request(client, due);
+                }
+                schedule.emplace(due + client.interval, index);
+            }
+            
+            uint64_t wait_until = schedule.empty() ? deadline : std::min(deadline, schedule.top().first);
+            // 用微秒精度的超时，毫秒取整会让每个请求平均晚发半毫秒
+            uint64_t wait = wait_until > now ? wait_until - now : 0;
+            timespec timeout{(time_t)(wait / 1000000), (long)(wait % 1000000 * 1000)};
+            int n = epoll_pwait2(epoll_fd, events, MAX_EVENTS, &timeout, nullptr);
+            for (int i = 0; i < n; ++i) {
+                Client& client = *clients[events[i].data.u32];
+                if (client.fd < 0) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    drop(client);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    flush(client);
+                }
+                if (events[i].events & EPOLLIN) {
+                    read_client(client, buffer);
+                }
+            }
+        }
+    }
+    
+private:
+    void send_upload(Client& client, uint64_t due) {
+        char message[256];
+        int len = snprintf(message, sizeof(message),
+            "{\"command\":\"upload\",\"device_id\":\"%s\",\"data\":{\"temperature\":%llu,\"soil_moisture\":%u,"
+            "\"temp_threshold\":30.0,\"moisture_threshold\":40.0,\"watering\":false}}\n",
+            client.device_id.c_str(), (unsigned long long)due, (unsigned)(rng() % 100));
+        client.uploads.push_back(due);
+        write_client(client, std::string_view(message, len));
+        counters.uploads.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    void send_request(Client& client, uint64_t due) {
+        char device_id[64];
+        snprintf(device_id, sizeof(device_id), "%s%05u", opts.prefix.c_str(), (unsigned)(rng() % opts.devices));
+        char message[256];
+        int len;
+        if (std::uniform_real_distribution<double>(0, 1)(rng) < opts.threshold_ratio) {
+            std::string request_id = std::to_string(next_request_id++);
+            len = snprintf(message, sizeof(message),
+                "{\"command\":\"set_threshold\",\"device_id\":\"%s\",\"temp_threshold\":31.0,"
+                "\"moisture_threshold\":41.0,\"request_id\":\"%s\"}\n", device_id, request_id.c_str());
+            client.thresholds.emplace(std::move(request_id), due);
+            counters.thresholds.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            len = snprintf(message, sizeof(message), "{\"command\":\"get_data\",\"device_id\":\"%s\"}\n", device_id);
+            client.gets[device_id].push_back(due);
+            counters.gets.fetch_add(1, std::memory_order_relaxed);
+        }
+        write_client(client, std::string_view(message, len));
+    }
+    
+    void handle_line(Client& client, std::string_view line) {
+        uint64_t now = now_us();
+        std::string_view command = json_field(line, "\"command\":");
+        std::string_view device_id = json_field(line, "\"device_id\":");
+        
+        if (client.device) {
+            if (command == "ack" && !client.uploads.empty()) {
+                upload_latency.record(now - client.uploads.front());
+                client.uploads.pop_front();
+                counters.upload_acks.fetch_add(1, std::memory_order_relaxed);
+            } else if (command == "update_threshold") {
+                // 像真实设备一样确认阈值更新
+                std::string ack = "{\"command\":\"ack\",\"device_id\":\"" + std::string(device_id)
+                    + "\",\"status\":\"success\",\"request_id\":\"" + std::string(json_field(line, "\"request_id\":")) + "\"}\n";
+                write_client(client, ack);
+            }
+            return;
+        }
+        
+        std::string_view request_id = json_field(line, "\"request_id\":");
+        if (command == "ack" && !request_id.empty()) {
+            auto it = client.thresholds.find(std::string(request_id));
+            if (it != client.thresholds.end()) {
+                threshold_latency.record(now - it->second);
+                client.thresholds.erase(it);
+                counters.threshold_acks.fetch_add(1, std::memory_order_relaxed);
+                if (json_field(line, "\"status\":") != "success") {
+                    counters.threshold_failures.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            return;
+        }
+        
+        // get_data的回复（包括device_not_found）按设备先进先出匹配；没有待回复请求的data_response是订阅推送
+        auto it = client.gets.find(std::string(device_id));
+        if ((command == "data_response" || command == "ack") && it != client.gets.end() && !it->second.empty()) {
+            get_latency.record(now - it->second.front());
+            it->second.pop_front();
+            counters.get_responses.fetch_add(1, std::memory_order_relaxed);
+        } else if (command == "data_response") {
+            uint64_t sent = strtoull(std::string(json_field(line, "\"temperature\":")).c_str(), nullptr, 10);
+            if (sent > 0 && sent <= now) {
+                push_latency.record(now - sent);
+            }
+            counters.pushes.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    
+    void read_client(Client& client, char* buffer) {
+        while (true) {
+            ssize_t n = recv(client.fd, buffer, BUFFER_SIZE, 0);
+            if (n > 0) {
+                client.inbuf.append(buffer, n);
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                drop(client);
+                return;
+            }
+            if (errno != EINTR) {
+                break;
+            }
+        }
+        size_t start = 0;
+        size_t end;
+        while ((end = client.inbuf.find('\n', start)) != std::string::npos) {
+            handle_line(client, std::string_view(client.inbuf).substr(start, end - start));
+            start = end + 1;
+        }
+        client.inbuf.erase(0, start);
+    }
+    
+    void write_client(Client& client, std::string_view data) {
+        if (client.fd < 0) {
+            return;
+        }
+        if (!client.outbuf.empty()) {
+            client.outbuf.append(data);
+            return;
+        }
+        ssize_t n = send(client.fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                drop(client);
+                return;
+            }
+            n = 0;
+        }
+        if ((size_t)n < data.size()) {
+            client.outbuf.append(data.substr(n));
+            set_want_write(client, true);
+        }
+    }
+    
+    void flush(Client& client) {
+        ssize_t n = send(client.fd, client.outbuf.data(), client.outbuf.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                drop(client);
+            }
+            return;
+        }
+        client.outbuf.erase(0, n);
+        if (client.outbuf.empty()) {
+            set_want_write(client, false);
+        }
+    }
+    
+    void set_want_write(Client& client, bool enable) {
+        if (client.want_write == enable) {
+            return;
+        }
+        client.want_write = enable;
+        epoll_event ev{};
+        ev.events = enable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        ev.data.u32 = client.index;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.fd, &ev);
+    }
+    
+    void drop(Client& client) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client.fd, nullptr);
+        close(client.fd);
+        client.fd = -1;
+        counters.errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    const Options& opts;
+    std::mt19937_64 rng;
+    int epoll_fd;
+    std::vector<std::unique_ptr<Client>> clients;
+    // (计划时间, 连接下标)，最早到期的在堆顶
+    std::priority_queue<std::pair<uint64_t, uint32_t>, std::vector<std::pair<uint64_t, uint32_t>>, std::greater<>> schedule;
+    uint64_t next_request_id = 1;
+};
+
+int connect_to(const Options& opts) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result;
+    if (getaddrinfo(opts.host.c_str(), std::to_string(opts.port).c_str(), &hints, &result) != 0) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+void print_latency(const char* name, const LatencyHistogram& histogram) {
+    if (histogram.count() == 0) {
+        printf("  %-16s no samples\n", name);
+        return;
+    }
+    printf("  %-16s count %-10llu p50 %8lluus  p99 %8lluus  p999 %8lluus  max %8lluus\n", name,
+           (unsigned long long)histogram.count(), (unsigned long long)histogram.percentile(0.5),
+           (unsigned long long)histogram.percentile(0.99), (unsigned long long)histogram.percentile(0.999),
+           (unsigned long long)histogram.maximum());
+}
+
+bool parse_number(const std::string& arg, size_t prefix_len, double& out) {
+    char* end;
+    out = strtod(arg.c_str() + prefix_len, &end);
+    return *end == '\0' && end != arg.c_str() + prefix_len;
+}
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        double value = 0;
+        bool ok = true;
+        if (arg.rfind("--host=", 0) == 0) {
+            opts.host = arg.substr(7);
+        } else if (arg.rfind("--port=", 0) == 0) {
+            ok = parse_number(arg, 7, value) && value > 0 && value < 65536;
+            opts.port = value;
+        } else if (arg.rfind("--devices=", 0) == 0) {
+            ok = parse_number(arg, 10, value) && value >= 0;
+            opts.devices = value;
+        } else if (arg.rfind("--pcs=", 0) == 0) {
+            ok = parse_number(arg, 6, value) && value >= 0;
+            opts.pcs = value;
+        } else if (arg.rfind("--upload-rate=", 0) == 0) {
+            ok = parse_number(arg, 14, opts.upload_rate) && opts.upload_rate > 0;
+        } else if (arg.rfind("--request-rate=", 0) == 0) {
+            ok = parse_number(arg, 15, opts.request_rate) && opts.request_rate > 0;
+        } else if (arg.rfind("--threshold-ratio=", 0) == 0) {
+            ok = parse_number(arg, 18, opts.threshold_ratio) && opts.threshold_ratio >= 0 && opts.threshold_ratio <= 1;
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            ok = parse_number(arg, 10, value) && value >= 1;
+            opts.threads = value;
+        } else if (arg.rfind("--duration=", 0) == 0) {
+            ok = parse_number(arg, 11, value) && value >= 1;
+            opts.duration = value;
+        } else if (arg.rfind("--prefix=", 0) == 0) {
+            opts.prefix = arg.substr(9);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << "Usage: " << argv[0] << " [--host=127.0.0.1] [--port=7878] [--devices=1000] [--pcs=10]"
+                      << " [--upload-rate=1] [--request-rate=10] [--threshold-ratio=0.1] [--threads=4]"
+                      << " [--duration=10] [--prefix=lg_]" << std::endl;
+            return 1;
+        }
+    }
+    if (opts.pcs > 0 && opts.devices == 0) {
+        std::cerr << "PC clients need at least one device to query" << std::endl;
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    // 每个连接一个fd，尽量放宽上限
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (unsigned i = 0; i < opts.threads; ++i) {
+        workers.push_back(std::make_unique<Worker>(opts, i + 1));
+    }
+    
+    // 连接在启动线程前全部建好，按轮转分给各线程
+    unsigned total = opts.devices + opts.pcs;
+    for (unsigned i = 0; i < total; ++i) {
+        int fd = connect_to(opts);
+        if (fd < 0) {
+            std::cerr << "Failed to connect to " << opts.host << ":" << opts.port << " (connection " << i + 1
+                      << "): " << strerror(errno) << std::endl;
+            return 1;
+        }
+        bool device = i < opts.devices;
+        char device_id[64] = "";
+        if (device) {
+            snprintf(device_id, sizeof(device_id), "%s%05u", opts.prefix.c_str(), i);
+        }
+        workers[i % opts.threads]->add(fd, device, device_id, device ? opts.upload_rate : opts.request_rate);
+    }
+    printf("Connected %u devices and %u PCs, running for %u s on %u threads\n", opts.devices, opts.pcs, opts.duration, opts.threads);
+    
+    uint64_t deadline = now_us() + (uint64_t)opts.duration * 1000000;
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back(&Worker::run, worker.get(), deadline);
+    }
+    
+    // 每秒输出一次各类消息的速率
+    auto sum = [&](std::atomic<uint64_t> Counters::* field) {
+        uint64_t value = 0;
+        for (auto& worker : workers) {
+            value += (worker->counters.*field).load(std::memory_order_relaxed);
+        }
+        return value;
+    };
+    uint64_t last[5] = {};
+    for (unsigned second = 1; now_us() < deadline; ++second) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(REPORT_INTERVAL_MS));
+        uint64_t current[5] = {sum(&Counters::upload_acks), sum(&Counters::get_responses),
+                               sum(&Counters::threshold_acks), sum(&Counters::pushes), sum(&Counters::errors)};
+        printf("[%3us] upload acks %8llu/s  get_data %7llu/s  set_threshold %6llu/s  pushes %8llu/s  disconnects %llu\n", second,
+               (unsigned long long)(current[0] - last[0]), (unsigned long long)(current[1] - last[1]),
+               (unsigned long long)(current[2] - last[2]), (unsigned long long)(current[3] - last[3]),
+               (unsigned long long)current[4]);
+        fflush(stdout);
+        std::copy(current, current + 5, last);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    
+    LatencyHistogram upload_latency;
+    LatencyHistogram get_latency;
+    LatencyHistogram threshold_latency;
+    LatencyHistogram push_latency;
+    for (auto& worker : workers) {
+        upload_latency.merge(worker->upload_latency);
+        get_latency.merge(worker->get_latency);
+        threshold_latency.merge(worker->threshold_latency);
+        push_latency.merge(worker->push_latency);
+    }
+    
+    double seconds = opts.duration;
+    printf("\nSummary: %llu uploads (%.0f/s), %llu get_data (%.0f/s), %llu set_threshold (%llu not success), %llu pushes (%.0f/s)\n",
+           (unsigned long long)sum(&Counters::uploads), sum(&Counters::upload_acks) / seconds,
+           (unsigned long long)sum(&Counters::gets), sum(&Counters::get_responses) / seconds,
+           (unsigned long long)sum(&Counters::thresholds), (unsigned long long)sum(&Counters::threshold_failures),
+           (unsigned long long)sum(&Counters::pushes), sum(&Counters::pushes) / seconds);
+    print_latency("upload -> ack", upload_latency);
+    print_latency("get_data", get_latency);
+    print_latency("set_threshold", threshold_latency);
+    print_latency("push", push_latency);
+    return sum(&Counters::errors) > 0 ? 2 : 0;
+}
@@ -1,23 +1,270 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <cerrno>
+#include <charconv>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <jsoncpp/json/json.h>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <functional>
 #include <thread>
 #include <vector>
+#include <array>
 #include <atomic>
+#include <type_traits>
+#include <algorithm>
+#include <deque>
+#include <chrono>
 
 #define PORT 7878
 #define BUFFER_SIZE 4096
+#define MAX_EVENTS 256
+#define MAX_FRAME_SIZE (1024 * 1024)
+#define DEVICE_DATA_BYTES 33     // DeviceData的定长编码：4个double加1字节浇水状态
+#define URING_ENTRIES 1024
+#define URING_BUFFER_COUNT 1024  // 每个ring提供的接收缓冲区个数，必须是2的幂
+#define MAX_STRUCTURALS 16384    // 快速路径单帧最多的结构字符数（约500个批量采样），超出走jsoncpp
+#define DEVICE_SHARDS 64         // 设备表分片数
+#define MAX_OUTBOUND_BYTES (4 * 1024 * 1024)  // 单连接待发数据上限，超出视为慢连接并断开
+#define MAX_MULTI_DEVICES 5000   // get_data_multi单次最多返回的设备数
+#define COMMAND_TIMEOUT_MS 5000  // 下发给设备的命令等待确认的时间
+#define HISTORY_CAPACITY 1024    // 每个设备保留的历史采样数，必须是HISTORY_BLOCK_SAMPLES的整数倍
+#define HISTORY_BLOCK_SAMPLES 256 // 每个压缩块的采样数
+#define WAL_COMMIT_INTERVAL_MS 10 // WAL组提交的最长等待时间
+#define WAL_SNAPSHOT_BYTES (64 * 1024 * 1024) // WAL超过该大小时写快照并换新文件
+#define LOG_RING_SIZE 1024       // 每个线程的日志缓冲区条数，必须是2的幂
+#define LOG_RECORD_SIZE 256      // 单条日志最大长度，超出截断
+#define LOG_SAMPLE_PER_SECOND 20 // INFO级别下每个线程每秒最多输出的报文内容条数
 
-std::mutex data_mutex;
 std::mutex clients_mutex;
+std::atomic<int64_t> client_counts[3];   // 按ClientType统计的连接数，供metrics读取而不加clients_mutex
 std::atomic<bool> server_running(true);
+std::atomic<uint64_t> next_connection_id(1);
+std::atomic<uint64_t> next_request_id(1);
+
+enum LogLevel {
+    LOG_DEBUG = 0,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+};
+
+std::atomic<int> log_level(LOG_INFO);
+
+// 异步日志：每个线程写自己的单生产者环形缓冲区，由后台线程统一输出。
+// 缓冲区满时丢弃并计数，记录日志的线程不会因为输出慢而阻塞
+class AsyncLogger {
+public:
+    AsyncLogger() : writer(&AsyncLogger::writer_loop, this) {}
+    ~AsyncLogger() { stop(); }
+    
+    void push(int level, const char* text, size_t len) {
+        Ring& ring = local_ring();
+        uint32_t head = ring.head.load(std::memory_order_relaxed);
+        if (head - ring.tail.load(std::memory_order_acquire) == LOG_RING_SIZE) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        Record& record = ring.records[head & (LOG_RING_SIZE - 1)];
+        record.level = level;
+        record.len = len;
+        memcpy(record.text, text, len);
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+    
+    // 输出完剩余的日志后停止后台线程
+    void stop() {
+        if (running.exchange(false)) {
+            writer.join();
+        }
+    }
+    
+private:
+    struct Record {
+        uint8_t level;
+        uint16_t len;
+        char text[LOG_RECORD_SIZE];
+    };
+    
+    struct Ring {
+        Record records[LOG_RING_SIZE];
+        alignas(64) std::atomic<uint32_t> head{0};   // 只由所属线程写
+        alignas(64) std::atomic<uint32_t> tail{0};   // 只由后台线程写
+    };
+    
+    // 线程第一次记日志时登记自己的缓冲区；线程退出后缓冲区保留，未输出的日志不会丢
+    Ring& local_ring() {
+        thread_local Ring* ring = nullptr;
+        if (!ring) {
+            auto owned = std::make_unique<Ring>();
+            ring = owned.get();
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            rings.push_back(std::move(owned));
+        }
+        return *ring;
+    }
+    
+    // WARN及以上写stderr，其余写stdout
+    bool drain(std::string& out, std::string& err) {
+        std::vector<Ring*> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            for (const auto& ring : rings) {
+                snapshot.push_back(ring.get());
+            }
+        }
+        for (Ring* ring : snapshot) {
+            uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+            uint32_t head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; ++tail) {
+                const Record& record = ring->records[tail & (LOG_RING_SIZE - 1)];
+                std::string& dest = record.level >= LOG_WARN ? err : out;
+                dest.append(record.text, record.len);
+                dest.push_back('\n');
+            }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+        uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost > 0) {
+            err += "Logger dropped " + std::to_string(lost) + " messages\n";
+        }
+        return !out.empty() || !err.empty();
+    }
+    
+    void writer_loop() {
+        std::string out;
+        std::string err;
+        while (true) {
+            bool active = running.load();
+            if (drain(out, err)) {
+                fwrite(out.data(), 1, out.size(), stdout);
+                fflush(stdout);
+                fwrite(err.data(), 1, err.size(), stderr);
+                out.clear();
+                err.clear();
+            } else if (!active) {
+                break;
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            }
+        }
+    }
+    
+    std::mutex rings_mutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> running{true};
+    std::thread writer;   // 放在最后，其余成员初始化完才启动
+};
+
+AsyncLogger logger;
+
+// 在栈上拼好一条日志，析构时交给logger，超长部分截断
+class LogLine {
+public:
+    explicit LogLine(int line_level) : level(line_level) {}
+    ~LogLine() { logger.push(level, text, len); }
+    
+    LogLine& operator<<(std::string_view s) {
+        size_t n = std::min(s.size(), sizeof(text) - len);
+        memcpy(text + len, s.data(), n);
+        len += n;
+        return *this;
+    }
+    LogLine& operator<<(const char* s) { return *this << std::string_view(s); }
+    LogLine& operator<<(const std::string& s) { return *this << std::string_view(s); }
+    LogLine& operator<<(char c) { return *this << std::string_view(&c, 1); }
+    
+    template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    LogLine& operator<<(T value) {
+        char buf[24];
+        auto result = std::to_chars(buf, buf + sizeof(buf), value);
+        return *this << std::string_view(buf, result.ptr - buf);
+    }
+    
+    LogLine& operator<<(double value) {
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "%g", value);
+        return *this << std::string_view(buf, n);
+    }
+    
+private:
+    int level;
+    size_t len = 0;
+    char text[LOG_RECORD_SIZE];
+};
+
+// 低于当前级别的日志连参数都不求值
+#define LOG(level) if ((level) < log_level.load(std::memory_order_relaxed)) {} else LogLine(level)
+
+// 二进制消息以类型字节（小于0x20的非空白字符）开头，JSON正文以'{'开头
+bool is_binary_frame(std::string_view frame) {
+    return !frame.empty() && (uint8_t)frame[0] < 0x20 && !isspace((unsigned char)frame[0]);
+}
+
+// 报文内容日志：DEBUG级别全部输出，INFO级别每个线程每秒最多输出LOG_SAMPLE_PER_SECOND条
+void log_payload(const char* what, std::string_view payload) {
+    int level = log_level.load(std::memory_order_relaxed);
+    if (level > LOG_INFO) {
+        return;
+    }
+    if (level == LOG_INFO) {
+        thread_local int64_t window = 0;
+        thread_local unsigned logged = 0;
+        thread_local unsigned suppressed = 0;
+        int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        if (now != window) {
+            if (suppressed > 0) {
+                LogLine(LOG_INFO) << "(" << suppressed << " payload logs suppressed)";
+            }
+            window = now;
+            logged = suppressed = 0;
+        }
+        if (++logged > LOG_SAMPLE_PER_SECOND) {
+            ++suppressed;
+            return;
+        }
+    }
+    if (is_binary_frame(payload)) {
+        // 二进制消息按十六进制输出，超出单条日志长度的部分截断
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        for (unsigned char c : payload.substr(0, LOG_RECORD_SIZE / 3)) {
+            hex += digits[c >> 4];
+            hex += digits[c & 15];
+            hex += ' ';
+        }
+        LogLine(LOG_INFO) << what << hex;
+        return;
+    }
+    LogLine(LOG_INFO) << what << payload;
+}
 
 struct DeviceData {
     double temperature;
@@ -27,8 +274,69 @@ struct DeviceData {
     bool watering;
 };
 
-std::map<std::string, DeviceData> device_data_map;
-std::map<int, std::pair<std::string, int>> connected_clients; // socket_fd -> (device_id, client_type)
+// DeviceData的定长编码（小端），WAL、快照和二进制协议共用
+void pack_device_data(char* out, const DeviceData& data) {
+    memcpy(out, &data.temperature, sizeof(double));
+    memcpy(out + 8, &data.soil_moisture, sizeof(double));
+    memcpy(out + 16, &data.temp_threshold, sizeof(double));
+    memcpy(out + 24, &data.moisture_threshold, sizeof(double));
+    out[32] = data.watering;
+}
+
+void unpack_device_data(const char* in, DeviceData& data) {
+    memcpy(&data.temperature, in, sizeof(double));
+    memcpy(&data.soil_moisture, in + 8, sizeof(double));
+    memcpy(&data.temp_threshold, in + 16, sizeof(double));
+    memcpy(&data.moisture_threshold, in + 24, sizeof(double));
+    data.watering = in[32] != 0;
+}
+
+// upload_batch中的一个采样
+struct BatchSample {
+    std::string_view device_id;      // 缺省时为外层的device_id
+    int64_t timestamp = 0;           // 设备采样时间（Unix毫秒），缺省时用服务器收到的时间
+    DeviceData data{};
+};
+
+enum CommandType {
+    CMD_UNKNOWN = 0,
+    CMD_UPLOAD,
+    CMD_GET_DATA,
+    CMD_SET_THRESHOLD,
+    CMD_ACK,
+    CMD_SUBSCRIBE,
+    CMD_UNSUBSCRIBE,
+    CMD_GET_HISTORY,
+    CMD_UPLOAD_BATCH,
+    CMD_GET_DATA_MULTI,
+    CMD_HELLO
+};
+
+// 二进制协议的消息类型，即正文首字节。连接用hello协商后，长度前缀帧的正文可以是二进制消息或JSON
+enum BinaryType : uint8_t {
+    BIN_UPLOAD = 1,             // 设备 -> 服务器：device_id | DeviceData
+    BIN_ACK = 2,                // 双向：device_id | status | request_id
+    BIN_GET_DATA = 3,           // 监控端 -> 服务器：device_id
+    BIN_DATA_RESPONSE = 4,      // 服务器 -> 监控端：device_id | DeviceData
+    BIN_UPDATE_THRESHOLD = 5    // 服务器 -> 设备：device_id | 温度阈值 | 湿度阈值 | request_id
+};
+
+// 解码后的消息，字符串字段是指向帧（或兜底解析的存储）的视图
+struct Message {
+    CommandType type = CMD_UNKNOWN;
+    std::string_view command;
+    std::string_view device_id;
+    std::string_view status;
+    std::string_view request_id;
+    std::string_view protocol;       // hello协商的编码
+    DeviceData data{};
+    double temp_threshold = 0;
+    double moisture_threshold = 0;
+    double from = 0;                 // get_history的时间范围（Unix毫秒）
+    double to = 0;
+    std::vector<BatchSample> samples;  // upload_batch的采样
+    std::vector<std::string_view> device_ids; // get_data_multi的设备列表
+};
 
 enum ClientType {
     CLIENT_UNKNOWN = 0,
@@ -36,283 +344,4682 @@ enum ClientType {
     CLIENT_PC = 2
 };
 
-std::string create_ack(const std::string& device_id, const std::string& status) {
-    Json::Value root;
-    root["command"] = "ack";
-    root["device_id"] = device_id;
-    root["status"] = status;
+enum FrameMode : uint8_t {
+    FRAME_UNKNOWN = 0,          // 尚未收到数据，由首字节决定
+    FRAME_NEWLINE = 1,          // JSON文本，以'\n'分隔
+    FRAME_LENGTH_PREFIXED = 2,  // 4字节大端长度 + JSON，首字节为0
+    FRAME_WEBSOCKET = 3,        // HTTP升级后的WebSocket，首字节为'G'（GET请求）
+    FRAME_MQTT = 4              // MQTT端口上的连接，accept时即确定
+};
+
+// 可增长的接收缓冲区：新数据追加到尾部，帧以视图形式从头部取出；
+// 半帧原地保留到下次读取，只有尾部空间不足时才前移或扩容
+class RecvBuffer {
+public:
+    const char* data() const { return storage.get() + head; }
+    size_t size() const { return tail - head; }
+    bool empty() const { return head == tail; }
+    char* write_ptr() { return storage.get() + tail; }
+    size_t writable() const { return capacity - tail; }
+    void commit(size_t n) { tail += n; }
+    
+    void consume(size_t n) {
+        head += n;
+        if (head == tail) {
+            head = tail = 0;
+            // 大帧处理完后释放多余内存，空闲连接不长期占用
+            if (capacity > BUFFER_SIZE * 4) {
+                storage.reset();
+                capacity = 0;
+            }
+        }
+    }
+    
+    void reserve(size_t n) {
+        if (writable() >= n) {
+            return;
+        }
+        size_t live = size();
+        if (capacity - live >= n) {
+            memmove(storage.get(), data(), live);
+        } else {
+            size_t new_capacity = std::max<size_t>({capacity * 2, live + n, BUFFER_SIZE});
+            std::unique_ptr<char[]> grown(new char[new_capacity]);
+            if (live > 0) {
+                memcpy(grown.get(), data(), live);
+            }
+            storage = std::move(grown);
+            capacity = new_capacity;
+        }
+        head = 0;
+        tail = live;
+    }
+    
+    void append(const char* src, size_t n) {
+        reserve(n);
+        memcpy(write_ptr(), src, n);
+        commit(n);
+    }
+    
+private:
+    std::unique_ptr<char[]> storage;
+    size_t capacity = 0;
+    size_t head = 0;
+    size_t tail = 0;
+};
+
+// 流式分帧。NEWLINE模式下顶层JSON对象闭合即为一帧结束，对象内的换行不分帧，
+// 因此带缩进的多行JSON和不带换行的旧固件都兼容；扫描状态跨读取保留，半帧不会被重复扫描
+class FrameParser {
+public:
+    std::atomic<uint8_t> mode{FRAME_UNKNOWN};
+    
+    // 从data中切出所有完整帧交给on_frame，返回已消费的字节数；协议错误返回-1
+    template <typename Handler>
+    ssize_t extract(const char* data, size_t len, Handler&& on_frame) {
+        size_t pos = 0;
+        while (pos < len) {
+            if (mode == FRAME_UNKNOWN) {
+                mode = data[pos] == '\0' ? FRAME_LENGTH_PREFIXED : FRAME_NEWLINE;
+            }
+            
+            if (mode == FRAME_LENGTH_PREFIXED) {
+                if (len - pos < 4) {
+                    break;
+                }
+                const unsigned char* header = reinterpret_cast<const unsigned char*>(data + pos);
+                uint32_t frame_len = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+                if (frame_len > MAX_FRAME_SIZE) {
+                    return -1;
+                }
+                if (len - pos - 4 < frame_len) {
+                    break;
+                }
+                on_frame(std::string_view(data + pos + 4, frame_len));
+                pos += 4 + frame_len;
+                continue;
+            }
+            
+            if (scanned == 0) {
+                // 跳过帧之间的空白（包括对象后多余的换行）
+                while (pos < len && isspace((unsigned char)data[pos])) {
+                    ++pos;
+                }
+                if (pos == len) {
+                    break;
+                }
+            }
+            
+            size_t i = pos + scanned;
+            size_t frame_end = 0;
+            size_t next = 0;
+            for (; i < len; ++i) {
+                char c = data[i];
+                if (in_string) {
+                    if (escaped) {
+                        escaped = false;
+                    } else if (c == '\\') {
+                        escaped = true;
+                    } else if (c == '"') {
+                        in_string = false;
+                    }
+                } else if (c == '"') {
+                    in_string = true;
+                } else if (c == '{' || c == '[') {
+                    ++depth;
+                } else if (c == '}' || c == ']') {
+                    if (depth == 0) {
+                        return -1; // 没有对应开括号的闭括号
+                    }
+                    if (--depth == 0) {
+                        frame_end = next = i + 1;
+                        break;
+                    }
+                } else if (c == '\n' && depth == 0) {
+                    frame_end = i;
+                    next = i + 1;
+                    break;
+                }
+            }
+            
+            if (next == 0) {
+                scanned = i - pos;
+                if (scanned > MAX_FRAME_SIZE) {
+                    return -1;
+                }
+                break;
+            }
+            
+            scanned = 0;
+            depth = 0;
+            in_string = escaped = false;
+            on_frame(std::string_view(data + pos, frame_end - pos));
+            pos = next;
+        }
+        return pos;
+    }
+    
+private:
+    size_t scanned = 0;      // 当前半帧已扫描的字节数
+    int depth = 0;
+    bool in_string = false;
+    bool escaped = false;
+};
+
+// SHA-1，只用于计算WebSocket握手的Sec-WebSocket-Accept
+std::array<uint8_t, 20> sha1(std::string_view input) {
+    auto rotl = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::string padded(input);
+    uint64_t bit_len = (uint64_t)input.size() * 8;
+    padded.push_back((char)0x80);
+    while (padded.size() % 64 != 56) {
+        padded.push_back('\0');
+    }
+    for (int i = 7; i >= 0; --i) {
+        padded.push_back((char)(bit_len >> (i * 8)));
+    }
+    
+    for (size_t chunk = 0; chunk < padded.size(); chunk += 64) {
+        const unsigned char* block = reinterpret_cast<const unsigned char*>(padded.data() + chunk);
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 80; ++i) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    
+    std::array<uint8_t, 20> digest;
+    for (int i = 0; i < 20; ++i) {
+        digest[i] = (uint8_t)(h[i / 4] >> (24 - 8 * (i % 4)));
+    }
+    return digest;
+}
+
+std::string base64_encode(const uint8_t* data, size_t len) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t group = (uint32_t)data[i] << 16;
+        if (i + 1 < len) {
+            group |= (uint32_t)data[i + 1] << 8;
+        }
+        if (i + 2 < len) {
+            group |= data[i + 2];
+        }
+        out.push_back(alphabet[(group >> 18) & 63]);
+        out.push_back(alphabet[(group >> 12) & 63]);
+        out.push_back(i + 1 < len ? alphabet[(group >> 6) & 63] : '=');
+        out.push_back(i + 2 < len ? alphabet[group & 63] : '=');
+    }
+    return out;
+}
+
+bool equals_ignore_case(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return tolower((unsigned char)x) == tolower((unsigned char)y);
+    });
+}
+
+// HTTP请求头中的字段值（字段名不区分大小写，去掉首尾空白），没有该字段时返回空
+std::string_view http_header(std::string_view request, std::string_view name) {
+    size_t pos = request.find("\r\n");
+    while (pos != std::string_view::npos && pos + 2 < request.size()) {
+        size_t start = pos + 2;
+        pos = request.find("\r\n", start);
+        std::string_view line = request.substr(start, pos == std::string_view::npos ? std::string_view::npos : pos - start);
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos || !equals_ignore_case(line.substr(0, colon), name)) {
+            continue;
+        }
+        std::string_view value = line.substr(colon + 1);
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+            value.remove_prefix(1);
+        }
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+            value.remove_suffix(1);
+        }
+        return value;
+    }
+    return {};
+}
+
+enum WebSocketOpcode : uint8_t {
+    WS_CONTINUATION = 0,
+    WS_TEXT = 1,
+    WS_BINARY = 2,
+    WS_CLOSE = 8,
+    WS_PING = 9,
+    WS_PONG = 10
+};
+
+// 服务器发出的WebSocket帧：不分片、不加掩码
+std::string websocket_frame(uint8_t opcode, std::string_view payload) {
+    std::string frame;
+    frame.reserve(payload.size() + 10);
+    frame.push_back((char)(0x80 | opcode));
+    if (payload.size() < 126) {
+        frame.push_back((char)payload.size());
+    } else if (payload.size() <= 0xFFFF) {
+        frame.push_back((char)126);
+        frame.push_back((char)(payload.size() >> 8));
+        frame.push_back((char)payload.size());
+    } else {
+        frame.push_back((char)127);
+        for (int i = 7; i >= 0; --i) {
+            frame.push_back((char)((uint64_t)payload.size() >> (i * 8)));
+        }
+    }
+    frame.append(payload);
+    return frame;
+}
+
+// WebSocket（RFC 6455）服务端的接收状态。连接上的第一个请求是HTTP升级握手，之后每条完整的
+// 文本或二进制消息（可分片）作为一帧交给on_message，内容与TCP连接上的JSON相同。
+// 握手回复和控制帧的回复经reply原样发出；协议错误返回-1
+class WebSocketParser {
+public:
+    template <typename Handler, typename Reply>
+    ssize_t extract(const char* data, size_t len, Handler&& on_message, Reply&& reply) {
+        size_t pos = 0;
+        if (closing) {
+            return len; // 已回复关闭帧或握手失败，丢弃之后的数据等对端断开
+        }
+        if (!upgraded) {
+            std::string_view request(data, len);
+            size_t end = request.find("\r\n\r\n");
+            if (end == std::string_view::npos) {
+                return len > MAX_HANDSHAKE_SIZE ? -1 : 0;
+            }
+            request = request.substr(0, end + 2);
+            std::string_view key = http_header(request, "Sec-WebSocket-Key");
+            std::string_view upgrade = http_header(request, "Upgrade");
+            if (key.empty() || !equals_ignore_case(upgrade, "websocket")) {
+                // 回复后等对端断开；立即断开的话io_uring引擎可能还没把回复发出去
+                reply("HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+                closing = true;
+                return len;
+            }
+            auto digest = sha1(std::string(key) + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+            reply("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                  "Sec-WebSocket-Accept: " + base64_encode(digest.data(), digest.size()) + "\r\n\r\n");
+            upgraded = true;
+            pos = end + 4;
+        }
+        
+        while (pos < len && !closing) {
+            const unsigned char* header = reinterpret_cast<const unsigned char*>(data + pos);
+            size_t available = len - pos;
+            if (available < 2) {
+                break;
+            }
+            bool fin = header[0] & 0x80;
+            uint8_t opcode = header[0] & 0x0F;
+            // 客户端的帧必须带掩码，扩展位未协商时必须为0
+            if ((header[0] & 0x70) || !(header[1] & 0x80)) {
+                return -1;
+            }
+            uint64_t payload_len = header[1] & 0x7F;
+            size_t header_len = 2;
+            if (payload_len == 126) {
+                if (available < 4) {
+                    break;
+                }
+                payload_len = (uint64_t)header[2] << 8 | header[3];
+                header_len = 4;
+            } else if (payload_len == 127) {
+                if (available < 10) {
+                    break;
+                }
+                payload_len = 0;
+                for (int i = 0; i < 8; ++i) {
+                    payload_len = payload_len << 8 | header[2 + i];
+                }
+                header_len = 10;
+            }
+            if (payload_len > MAX_FRAME_SIZE) {
+                return -1;
+            }
+            if (available < header_len + 4 + payload_len) {
+                break;
+            }
+            const unsigned char* mask = header + header_len;
+            const char* payload = data + pos + header_len + 4;
+            pos += header_len + 4 + payload_len;
+            
+            if (opcode >= WS_CLOSE) {
+                if (!fin || payload_len > 125) {
+                    return -1;
+                }
+                std::string body;
+                unmask(body, payload, payload_len, mask);
+                if (opcode == WS_PING) {
+                    reply(websocket_frame(WS_PONG, body));
+                } else if (opcode == WS_CLOSE) {
+                    // 回复时带回对方的状态码
+                    reply(websocket_frame(WS_CLOSE, std::string_view(body).substr(0, 2)));
+                    closing = true;
+                } else if (opcode != WS_PONG) {
+                    return -1;
+                }
+                continue;
+            }
+            
+            // 分片消息：首帧带类型，后续为CONTINUATION
+            if (opcode == WS_CONTINUATION ? message_opcode == 0 : (message_opcode != 0 || opcode > WS_BINARY)) {
+                return -1;
+            }
+            if (opcode != WS_CONTINUATION) {
+                message_opcode = opcode;
+            }
+            if (message.size() + payload_len > MAX_FRAME_SIZE) {
+                return -1;
+            }
+            unmask(message, payload, payload_len, mask);
+            if (fin) {
+                on_message(std::string_view(message));
+                message.clear();
+                message_opcode = 0;
+            }
+        }
+        return closing ? len : pos;
+    }
+    
+private:
+    static constexpr size_t MAX_HANDSHAKE_SIZE = 8192;
+    
+    static void unmask(std::string& out, const char* payload, size_t len, const unsigned char* mask) {
+        size_t start = out.size();
+        out.resize(start + len);
+        for (size_t i = 0; i < len; ++i) {
+            out[start + i] = payload[i] ^ mask[i & 3];
+        }
+    }
+    
+    bool upgraded = false;
+    bool closing = false;
+    uint8_t message_opcode = 0;  // 正在接收的分片消息的类型，0表示没有
+    std::string message;         // 已去掉掩码的分片消息
+};
+
+enum MqttPacketType : uint8_t {
+    MQTT_CONNECT = 1,
+    MQTT_CONNACK = 2,
+    MQTT_PUBLISH = 3,
+    MQTT_PUBACK = 4,
+    MQTT_SUBSCRIBE = 8,
+    MQTT_SUBACK = 9,
+    MQTT_UNSUBSCRIBE = 10,
+    MQTT_UNSUBACK = 11,
+    MQTT_PINGREQ = 12,
+    MQTT_PINGRESP = 13,
+    MQTT_DISCONNECT = 14
+};
+
+// 固定头 + 正文。剩余长度为变长编码，每字节低7位，最高位表示后面还有
+std::string mqtt_packet(uint8_t type, uint8_t flags, std::string_view body) {
+    std::string packet;
+    packet.reserve(body.size() + 5);
+    packet.push_back((char)(type << 4 | flags));
+    size_t len = body.size();
+    do {
+        uint8_t byte = len % 128;
+        len /= 128;
+        packet.push_back((char)(len > 0 ? byte | 0x80 : byte));
+    } while (len > 0);
+    packet.append(body);
+    return packet;
+}
+
+// QoS 0的PUBLISH
+std::string mqtt_publish(std::string_view topic, std::string_view payload) {
+    std::string body;
+    body.reserve(2 + topic.size() + payload.size());
+    body.push_back((char)(topic.size() >> 8));
+    body.push_back((char)topic.size());
+    body.append(topic);
+    body.append(payload);
+    return mqtt_packet(MQTT_PUBLISH, 0, body);
+}
+
+// 设备相关的主题为devices/<device_id>/<suffix>
+std::string mqtt_device_topic(std::string_view device_id, std::string_view suffix) {
+    std::string topic = "devices/";
+    topic.append(device_id);
+    topic.push_back('/');
+    topic.append(suffix);
+    return topic;
+}
+
+// 读取2字节大端长度加内容的字符串
+bool read_mqtt_string(std::string_view body, size_t& pos, std::string_view& out) {
+    if (body.size() - pos < 2) {
+        return false;
+    }
+    size_t len = (size_t)(uint8_t)body[pos] << 8 | (uint8_t)body[pos + 1];
+    if (body.size() - pos - 2 < len) {
+        return false;
+    }
+    out = body.substr(pos + 2, len);
+    pos += 2 + len;
+    return true;
+}
+
+// MQTT 3.1.1服务端的分包。CONNECT、PINGREQ和DISCONNECT在这里处理，
+// 其余报文交给on_packet(type, flags, body)，它返回false表示协议错误。
+// 回复经reply原样发出；协议错误返回-1
+class MqttParser {
+public:
+    template <typename Handler, typename Reply>
+    ssize_t extract(const char* data, size_t len, Handler&& on_packet, Reply&& reply) {
+        size_t pos = 0;
+        while (pos < len && !closing) {
+            const unsigned char* header = reinterpret_cast<const unsigned char*>(data + pos);
+            size_t available = len - pos;
+            size_t body_len = 0;
+            size_t header_len = 1;
+            bool complete = false;
+            for (int i = 0; i < 4 && header_len < available; ++i) {
+                uint8_t byte = header[header_len++];
+                body_len |= (size_t)(byte & 0x7F) << (7 * i);
+                if (!(byte & 0x80)) {
+                    complete = true;
+                    break;
+                }
+            }
+            if (!complete) {
+                if (header_len == 5) {
+                    return -1; // 剩余长度最多4字节
+                }
+                break;
+            }
+            if (body_len > MAX_FRAME_SIZE) {
+                return -1;
+            }
+            if (available - header_len < body_len) {
+                break;
+            }
+            uint8_t type = header[0] >> 4;
+            uint8_t flags = header[0] & 0x0F;
+            std::string_view body(data + pos + header_len, body_len);
+            pos += header_len + body_len;
+            
+            if (!connected) {
+                // 第一个报文必须是CONNECT
+                if (type != MQTT_CONNECT || !accept_connect(body, reply)) {
+                    return -1;
+                }
+            } else if (type == MQTT_PINGREQ) {
+                reply(mqtt_packet(MQTT_PINGRESP, 0, {}));
+            } else if (type == MQTT_DISCONNECT) {
+                closing = true;
+            } else if (type == MQTT_CONNECT || !on_packet(type, flags, body)) {
+                return -1;
+            }
+        }
+        return closing ? len : pos;
+    }
+    
+private:
+    // 只接受3.1.1（协议名MQTT、级别4）；遗嘱、用户名和密码不做处理，也不保留会话
+    template <typename Reply>
+    bool accept_connect(std::string_view body, Reply&& reply) {
+        size_t pos = 0;
+        std::string_view protocol;
+        std::string_view client_id;
+        if (!read_mqtt_string(body, pos, protocol) || body.size() - pos < 4) {
+            return false;
+        }
+        uint8_t level = body[pos];
+        pos += 4; // 级别、连接标志、keep alive
+        if (protocol != "MQTT" || level != 4) {
+            // 返回码1：不支持的协议版本，之后等对端断开
+            reply(mqtt_packet(MQTT_CONNACK, 0, std::string_view("\0\1", 2)));
+            closing = true;
+            return true;
+        }
+        if (!read_mqtt_string(body, pos, client_id)) {
+            return false;
+        }
+        LOG(LOG_INFO) << "MQTT client connected: " << client_id;
+        reply(mqtt_packet(MQTT_CONNACK, 0, std::string_view("\0\0", 2)));
+        connected = true;
+        return true;
+    }
+    
+    bool connected = false;
+    bool closing = false;        // 收到DISCONNECT或拒绝了连接，丢弃之后的数据等对端断开
+};
+
+// 处理一条消息的各阶段，分别统计耗时
+enum StatPhase {
+    PHASE_PARSE = 0,    // 分帧后的解码
+    PHASE_STORE,        // 设备表、订阅表、连接表的读写
+    PHASE_SERIALIZE,    // 生成回复
+    PHASE_SEND,         // 交给I/O引擎发送，包括推送给订阅者
+    PHASE_TOTAL,        // handle_message全程
+    PHASE_COUNT
+};
+
+const char* const PHASE_NAMES[PHASE_COUNT] = {"parse", "store", "serialize", "send", "total"};
+
+// 单写者计数器的累加：只有所属线程写，relaxed的load加store即可
+template <typename T>
+inline void add_local(std::atomic<T>& counter, T n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// HDR风格的耗时直方图（纳秒）：每个2的幂区间等分成16个桶，相对误差不超过1/16，
+// 2^40ns（约18分钟）以上的都记入最后一个桶。
+// 只由所属线程写，计数用relaxed的load加store，不产生加锁指令；汇总时读到的是近似一致的快照。
+// 推送的扇出数同样用它统计，单位为连接数
+class LatencyHistogram {
+public:
+    void record(uint64_t ns) {
+        add_local(counts[bucket(ns)], (uint64_t)1);
+        add_local(total, (uint64_t)1);
+        add_local(sum, ns);
+        if (ns > max.load(std::memory_order_relaxed)) {
+            max.store(ns, std::memory_order_relaxed);
+        }
+    }
+    
+    // 只用于汇总到调用线程自己的直方图
+    void merge(const LatencyHistogram& other) {
+        for (unsigned i = 0; i < BUCKETS; ++i) {
+            add_local(counts[i], other.counts[i].load(std::memory_order_relaxed));
+        }
+        add_local(total, other.total.load(std::memory_order_relaxed));
+        add_local(sum, other.sum.load(std::memory_order_relaxed));
+        max.store(std::max(maximum(), other.maximum()), std::memory_order_relaxed);
+    }
+    
+    // 不超过v的记录数，按桶的粒度计算：与v同桶的记录都算在内
+    uint64_t count_at_most(uint64_t v) const {
+        uint64_t result = 0;
+        for (unsigned i = 0; i <= bucket(v); ++i) {
+            result += counts[i].load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+    
+    // 第q分位所在桶的上界
+    uint64_t percentile(double q) const {
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)std::ceil(q * count()));
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < BUCKETS; ++i) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                return std::min(bucket_max(i), maximum());
+            }
+        }
+        return maximum();
+    }
+    
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t maximum() const { return max.load(std::memory_order_relaxed); }
+    uint64_t total_sum() const { return sum.load(std::memory_order_relaxed); }
+    uint64_t mean() const { return count() ? total_sum() / count() : 0; }
+    
+private:
+    static constexpr unsigned SUB_BITS = 4;
+    static constexpr unsigned MAX_BITS = 40;
+    static constexpr unsigned BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+    
+    static unsigned bucket(uint64_t v) {
+        if (v < (1u << SUB_BITS)) {
+            return v;
+        }
+        unsigned msb = 63 - __builtin_clzll(v);
+        if (msb >= MAX_BITS) {
+            return BUCKETS - 1;
+        }
+        unsigned shift = msb - SUB_BITS;
+        return ((shift + 1) << SUB_BITS) + ((v >> shift) & ((1u << SUB_BITS) - 1));
+    }
+    
+    static uint64_t bucket_max(unsigned b) {
+        if (b < (1u << SUB_BITS)) {
+            return b;
+        }
+        unsigned shift = (b >> SUB_BITS) - 1;
+        uint64_t mantissa = (b & ((1u << SUB_BITS) - 1)) | (1u << SUB_BITS);
+        return ((mantissa + 1) << shift) - 1;
+    }
+    
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+};
+
+// 一个线程的运行统计。每种命令每个阶段一个耗时直方图，直方图的个数即该命令（阶段）的处理次数，
+// CMD_UNKNOWN包括无法解码的帧
+struct ThreadStats {
+    LatencyHistogram latency[CMD_HELLO + 1][PHASE_COUNT];
+    LatencyHistogram fanout;                  // 每次推送的订阅者数
+    std::atomic<int64_t> outbound_bytes{0};   // 本线程造成的连接待发字节数增减，各线程相加为当前总量
+    
+    void merge(const ThreadStats& other) {
+        for (int type = 0; type <= CMD_HELLO; ++type) {
+            for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+                latency[type][phase].merge(other.latency[type][phase]);
+            }
+        }
+        fanout.merge(other.fanout);
+        add_local(outbound_bytes, other.outbound_bytes.load(std::memory_order_relaxed));
+    }
+};
+
+// 每个线程写自己的ThreadStats，stats控制台命令和metrics抓取时汇总。
+// 线程第一次记录时登记；线程退出后保留，它的计数仍计入汇总
+class ThreadStatsRegistry {
+public:
+    ThreadStats& local() {
+        thread_local ThreadStats* stats = nullptr;
+        if (!stats) {
+            auto owned = std::make_unique<ThreadStats>();
+            stats = owned.get();
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.push_back(std::move(owned));
+        }
+        return *stats;
+    }
+    
+    std::unique_ptr<ThreadStats> aggregate() {
+        auto result = std::make_unique<ThreadStats>();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& stats : threads) {
+            result->merge(*stats);
+        }
+        return result;
+    }
+    
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadStats>> threads;
+};
+
+ThreadStatsRegistry thread_stats;
+
+struct RenderedResponse;
+
+// 单个客户端连接，由接收它的I/O线程负责读写
+struct Connection : std::enable_shared_from_this<Connection> {
+    int fd;
+    uint64_t id;
+    std::string device_id;           // 受clients_mutex保护
+    int type = CLIENT_UNKNOWN;       // 受clients_mutex保护
+    std::atomic<bool> binary{false}; // 已协商二进制协议，只由所属I/O线程修改
+    std::set<std::string, std::less<>> routed_devices; // 经此连接批量上报的其他设备（集中器下挂的节点），受clients_mutex保护
+    
+    FrameParser framer;              // 以下四项只由所属I/O线程访问
+    RecvBuffer inbuf;
+    WebSocketParser websocket;
+    MqttParser mqtt;
+    
+    std::mutex send_mutex;
+    std::string pending_out;         // 尚未交给内核的数据
+    // 积压期间的设备推送，每个设备只保留最新一条，pending_out发完后再追加
+    std::vector<std::pair<std::string, std::shared_ptr<const RenderedResponse>>> conflated;
+    bool overflowed = false;         // 待发数据超限，连接正在关闭
+    bool closed = false;
+    
+    void* owner = nullptr;           // 所属I/O线程
+    bool flush_queued = false;       // 已在所属线程的待刷新列表中
+    
+    // io_uring引擎：同一时刻每个连接最多一个SEND在途
+    std::string sending;
+    size_t send_offset = 0;
+    bool send_inflight = false;
+    
+    int64_t outbound_accounted = 0;  // 已计入ThreadStats::outbound_bytes的pending_out字节数，受send_mutex保护
+    
+    explicit Connection(int socket_fd) : fd(socket_fd), id(next_connection_id++) {
+        client_counts[CLIENT_UNKNOWN].fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    ~Connection() {
+        client_counts[type].fetch_sub(1, std::memory_order_relaxed);
+        add_local(thread_stats.local().outbound_bytes, -outbound_accounted);
+    }
+};
+
+// I/O引擎接口：负责接受连接、读取数据并交给handle_message、以及发送
+class IoEngine {
+public:
+    virtual ~IoEngine() = default;
+    virtual const char* name() const = 0;
+    // mqtt_port为0时不监听MQTT
+    virtual bool start(int port, int mqtt_port, unsigned thread_count) = 0;
+    virtual void send(const std::shared_ptr<Connection>& conn, const std::string& message) = 0;
+    // 推送设备更新：连接有积压时按device_id合并，只发最新值
+    virtual void publish(const std::shared_ptr<Connection>& conn, std::string_view device_id,
+                         const std::shared_ptr<const RenderedResponse>& response) = 0;
+    virtual void stop() = 0;
+};
+
+// 某一版本设备数据渲染出的data_response。不可变，由get_data和广播共享，
+// 三种JSON帧格式、MQTT的PUBLISH和二进制消息各预先封装一份，推送给大量连接时不再逐个封装
+struct RenderedResponse {
+    uint64_t version;
+    std::string body;
+    std::string newline_frame;
+    std::string length_prefixed_frame;
+    std::string websocket_frame;
+    std::string mqtt_frame;          // 主题devices/<device_id>/data
+    std::string binary_frame;
+    
+    const std::string& frame_for(const Connection& conn) const {
+        if (conn.binary) {
+            return binary_frame;
+        }
+        switch (conn.framer.mode) {
+            case FRAME_LENGTH_PREFIXED:
+                return length_prefixed_frame;
+            case FRAME_WEBSOCKET:
+                return websocket_frame;
+            case FRAME_MQTT:
+                return mqtt_frame;
+            default:
+                return newline_frame;
+        }
+    }
+};
+
+// 以下四个函数调用时需持有conn.send_mutex
+
+// 修改pending_out后调用，把待发字节数的变化计入当前线程的统计
+void account_outbound(Connection& conn) {
+    int64_t queued = conn.pending_out.size();
+    add_local(thread_stats.local().outbound_bytes, queued - conn.outbound_accounted);
+    conn.outbound_accounted = queued;
+}
+
+// 积压时记下设备的最新推送，替换同一设备尚未发出的旧值
+void conflate_update(Connection& conn, std::string_view device_id, const std::shared_ptr<const RenderedResponse>& response) {
+    for (auto& update : conn.conflated) {
+        if (update.first == device_id) {
+            update.second = response;
+            return;
+        }
+    }
+    conn.conflated.emplace_back(std::string(device_id), response);
+}
+
+// 把合并后的推送追加到待发缓冲区
+void append_conflated(Connection& conn) {
+    for (const auto& update : conn.conflated) {
+        conn.pending_out += update.second->frame_for(conn);
+    }
+    conn.conflated.clear();
+}
+
+// 检查还能否再排队n字节；超限时丢弃积压并shutdown，由所属I/O线程按断开处理
+bool reserve_outbound(Connection& conn, size_t n) {
+    if (conn.pending_out.size() + n <= MAX_OUTBOUND_BYTES) {
+        return true;
+    }
+    LOG(LOG_WARN) << "Outbound queue overflow, closing slow client";
+    conn.overflowed = true;
+    conn.pending_out.clear();
+    conn.conflated.clear();
+    account_outbound(conn);
+    shutdown(conn.fd, SHUT_RDWR);
+    return false;
+}
+
+// 毫秒级Unix时间戳
+int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// 客户端给出的毫秒时间戳是double，直接转换超出int64范围时未定义：NaN按0处理，越界的截到两端
+int64_t timestamp_from_double(double value) {
+    if (std::isnan(value)) {
+        return 0;
+    }
+    if (value <= (double)INT64_MIN) {
+        return INT64_MIN;
+    }
+    if (value >= (double)INT64_MAX) {
+        return INT64_MAX;
+    }
+    return (int64_t)value;
+}
+
+struct HistorySample {
+    int64_t timestamp;               // 服务器收到上报的时间（Unix毫秒）
+    double temperature;
+    double soil_moisture;
+};
+
+// Gorilla压缩块：时间戳存delta-of-delta，温度和土壤湿度分别与前一个值异或后只存有效位。
+// 块在写满HISTORY_BLOCK_SAMPLES个采样后封存，查询时顺序流式解码
+class GorillaBlock {
+public:
+    size_t size() const { return samples; }
+    int64_t first_timestamp() const { return first_ts; }
+    int64_t last_timestamp() const { return last_ts; }
+    size_t memory_bytes() const { return sizeof(*this) + words.capacity() * sizeof(uint64_t); }
+    
+    void seal() { words.shrink_to_fit(); }
+    
+    // 时间戳必须不小于上一个采样
+    void append(const HistorySample& sample) {
+        if (samples == 0) {
+            write_bits(sample.timestamp, 64);
+            first_ts = sample.timestamp;
+        } else {
+            int64_t delta = sample.timestamp - last_ts;
+            int64_t dod = delta - prev_delta;
+            prev_delta = delta;
+            if (dod == 0) {
+                write_bits(0, 1);
+            } else if (dod >= -64 && dod <= 63) {
+                write_bits(0b10, 2);
+                write_bits(dod, 7);
+            } else if (dod >= -256 && dod <= 255) {
+                write_bits(0b110, 3);
+                write_bits(dod, 9);
+            } else if (dod >= -2048 && dod <= 2047) {
+                write_bits(0b1110, 4);
+                write_bits(dod, 12);
+            } else {
+                write_bits(0b1111, 4);
+                write_bits(dod, 64);
+            }
+        }
+        last_ts = sample.timestamp;
+        encode_value(temperature, sample.temperature);
+        encode_value(soil_moisture, sample.soil_moisture);
+        ++samples;
+    }
+    
+    template <typename Visitor>
+    void decode(Visitor&& visit) const {
+        BitReader reader{words.data()};
+        HistorySample sample{};
+        int64_t delta = 0;
+        XorState temp_state;
+        XorState moisture_state;
+        for (uint32_t i = 0; i < samples; ++i) {
+            if (i == 0) {
+                sample.timestamp = reader.read(64);
+            } else {
+                int64_t dod;
+                if (!reader.read(1)) {
+                    dod = 0;
+                } else if (!reader.read(1)) {
+                    dod = sign_extend(reader.read(7), 7);
+                } else if (!reader.read(1)) {
+                    dod = sign_extend(reader.read(9), 9);
+                } else if (!reader.read(1)) {
+                    dod = sign_extend(reader.read(12), 12);
+                } else {
+                    dod = reader.read(64);
+                }
+                delta += dod;
+                sample.timestamp += delta;
+            }
+            sample.temperature = decode_value(reader, temp_state, i == 0);
+            sample.soil_moisture = decode_value(reader, moisture_state, i == 0);
+            visit(sample);
+        }
+    }
+    
+private:
+    static constexpr uint8_t NO_WINDOW = 0xff;
+    
+    // 上一个值以及上一次存储有效位时的前导零、尾随零个数
+    struct XorState {
+        uint64_t prev = 0;
+        uint8_t leading = NO_WINDOW;
+        uint8_t trailing = 0;
+    };
+    
+    // 高位在前的位流读取
+    struct BitReader {
+        const uint64_t* words;
+        size_t pos = 0;
+        
+        uint64_t read(unsigned n) {
+            size_t index = pos / 64;
+            unsigned offset = pos % 64;
+            unsigned room = 64 - offset;
+            pos += n;
+            if (n <= room) {
+                return (words[index] << offset) >> (64 - n);
+            }
+            uint64_t high = words[index] & ((1ULL << room) - 1);
+            return (high << (n - room)) | (words[index + 1] >> (64 - (n - room)));
+        }
+    };
+    
+    static int64_t sign_extend(uint64_t value, unsigned bits) {
+        return (int64_t)(value << (64 - bits)) >> (64 - bits);
+    }
+    
+    void write_bits(uint64_t value, unsigned n) {
+        if (n < 64) {
+            value &= (1ULL << n) - 1;
+        }
+        unsigned offset = bit_count % 64;
+        if (offset == 0) {
+            words.push_back(0);
+        }
+        unsigned room = 64 - offset;
+        if (n <= room) {
+            words.back() |= value << (room - n);
+        } else {
+            words.back() |= value >> (n - room);
+            words.push_back(value << (64 - (n - room)));
+        }
+        bit_count += n;
+    }
+    
+    void encode_value(XorState& state, double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        if (samples == 0) {
+            write_bits(bits, 64);
+            state.prev = bits;
+            return;
+        }
+        uint64_t x = bits ^ state.prev;
+        state.prev = bits;
+        if (x == 0) {
+            write_bits(0, 1);
+            return;
+        }
+        unsigned leading = std::min(__builtin_clzll(x), 31);
+        unsigned trailing = __builtin_ctzll(x);
+        if (state.leading != NO_WINDOW && leading >= state.leading && trailing >= state.trailing) {
+            // 有效位落在上一次的窗口内，沿用窗口
+            write_bits(0b10, 2);
+            write_bits(x >> state.trailing, 64 - state.leading - state.trailing);
+        } else {
+            unsigned significant = 64 - leading - trailing;
+            write_bits(0b11, 2);
+            write_bits(leading, 5);
+            write_bits(significant & 63, 6);   // 64个有效位记为0
+            write_bits(x >> trailing, significant);
+            state.leading = leading;
+            state.trailing = trailing;
+        }
+    }
+    
+    static double decode_value(BitReader& reader, XorState& state, bool first) {
+        uint64_t bits;
+        if (first) {
+            bits = reader.read(64);
+        } else if (!reader.read(1)) {
+            bits = state.prev;
+        } else {
+            if (reader.read(1)) {
+                state.leading = reader.read(5);
+                unsigned significant = reader.read(6);
+                state.trailing = 64 - state.leading - (significant == 0 ? 64 : significant);
+            }
+            unsigned significant = 64 - state.leading - state.trailing;
+            bits = state.prev ^ (reader.read(significant) << state.trailing);
+        }
+        state.prev = bits;
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    
+    std::vector<uint64_t> words;
+    size_t bit_count = 0;
+    uint32_t samples = 0;
+    int64_t first_ts = 0;
+    int64_t last_ts = 0;
+    int64_t prev_delta = 0;
+    XorState temperature;
+    XorState soil_moisture;
+};
+
+// 按时间顺序保存最近约HISTORY_CAPACITY个采样：满了就丢弃最旧的整块
+class HistoryRing {
+public:
+    void append(HistorySample sample) {
+        // 系统时间回拨时保持时间戳单调，块内编码和范围查询都依赖这一点
+        if (!blocks.empty()) {
+            sample.timestamp = std::max(sample.timestamp, blocks.back().last_timestamp());
+        }
+        if (blocks.empty() || blocks.back().size() == HISTORY_BLOCK_SAMPLES) {
+            if (!blocks.empty()) {
+                blocks.back().seal();
+            }
+            if (blocks.size() == HISTORY_CAPACITY / HISTORY_BLOCK_SAMPLES) {
+                blocks.erase(blocks.begin());
+            }
+            blocks.emplace_back();
+        }
+        blocks.back().append(sample);
+    }
+    
+    // 取[from, to]内的采样，按时间升序追加到out；只解码时间范围有交集的块
+    void query(int64_t from, int64_t to, std::vector<HistorySample>& out) const {
+        for (const auto& block : blocks) {
+            if (block.last_timestamp() < from) {
+                continue;
+            }
+            if (block.first_timestamp() > to) {
+                break;
+            }
+            block.decode([&](const HistorySample& sample) {
+                if (sample.timestamp >= from && sample.timestamp <= to) {
+                    out.push_back(sample);
+                }
+            });
+        }
+    }
+    
+    size_t size() const {
+        size_t total = 0;
+        for (const auto& block : blocks) {
+            total += block.size();
+        }
+        return total;
+    }
+    
+    size_t memory_bytes() const {
+        size_t total = sizeof(*this);
+        for (const auto& block : blocks) {
+            total += block.memory_bytes();
+        }
+        return total + (blocks.capacity() - blocks.size()) * sizeof(GorillaBlock);
+    }
+    
+private:
+    std::vector<GorillaBlock> blocks;
+};
+
+struct DeviceEntry {
+    DeviceData data;
+    uint64_t version = 0;                               // 数据每次变化加1
+    std::shared_ptr<const RenderedResponse> rendered;   // 当前版本的缓存，首次读取时渲染，用atomic_load/store访问
+    HistoryRing history;
+};
+
+std::map<int, std::shared_ptr<Connection>> connected_clients; // socket_fd -> connection
+std::map<std::string, std::shared_ptr<Connection>, std::less<>> device_connections; // device_id -> 最近上报该设备的STM32连接，受clients_mutex保护
+std::unique_ptr<IoEngine> io_engine;
+
+// 紧凑输出（不含换行），便于按行分帧
+const Json::StreamWriterBuilder& json_writer() {
+    static const Json::StreamWriterBuilder writer = [] {
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";
+        return builder;
+    }();
+    return writer;
+}
+
+Json::Value json_string(std::string_view s) {
+    return Json::Value(s.data(), s.data() + s.size());
+}
+
+// request_id非空时带回给请求方
+std::string create_ack(std::string_view device_id, std::string_view status, std::string_view request_id = {}) {
+    Json::Value root;
+    root["command"] = "ack";
+    root["device_id"] = json_string(device_id);
+    root["status"] = json_string(status);
+    if (!request_id.empty()) {
+        root["request_id"] = json_string(request_id);
+    }
+    
+    return Json::writeString(json_writer(), root);
+}
+
+std::string render_data_response(std::string_view device_id, const DeviceData& data) {
+    Json::Value root;
+    root["command"] = "data_response";
+    root["device_id"] = json_string(device_id);
+    
+    Json::Value data_obj;
+    data_obj["temperature"] = data.temperature;
+    data_obj["soil_moisture"] = data.soil_moisture;
+    data_obj["temp_threshold"] = data.temp_threshold;
+    data_obj["moisture_threshold"] = data.moisture_threshold;
+    data_obj["watering"] = data.watering;
+    
+    root["data"] = data_obj;
+    
+    return Json::writeString(json_writer(), root);
+}
+
+// 把各设备缓存的data_response正文原样拼进一个数组，不再重新序列化
+std::string create_data_multi_response(const std::vector<std::shared_ptr<const RenderedResponse>>& responses,
+                                       const std::vector<std::string_view>& missing, bool truncated) {
+    size_t total = 64;
+    for (const auto& response : responses) {
+        total += response->body.size() + 1;
+    }
+    std::string out;
+    out.reserve(total);
+    out += "{\"command\":\"data_multi_response\",\"devices\":[";
+    for (size_t i = 0; i < responses.size(); ++i) {
+        if (i > 0) {
+            out += ',';
+        }
+        out += responses[i]->body;
+    }
+    out += ']';
+    if (!missing.empty()) {
+        Json::Value list(Json::arrayValue);
+        for (std::string_view device_id : missing) {
+            list.append(json_string(device_id));
+        }
+        out += ",\"not_found\":";
+        out += Json::writeString(json_writer(), list);
+    }
+    if (truncated) {
+        out += ",\"truncated\":true";
+    }
+    out += '}';
+    return out;
+}
+
+std::string create_history_response(std::string_view device_id, const std::vector<HistorySample>& samples) {
+    Json::Value root;
+    root["command"] = "history_response";
+    root["device_id"] = json_string(device_id);
+    
+    Json::Value& list = root["samples"] = Json::Value(Json::arrayValue);
+    for (const auto& sample : samples) {
+        Json::Value item;
+        item["timestamp"] = (Json::Int64)sample.timestamp;
+        item["temperature"] = sample.temperature;
+        item["soil_moisture"] = sample.soil_moisture;
+        list.append(item);
+    }
+    
+    return Json::writeString(json_writer(), root);
+}
+
+std::string create_update_threshold(std::string_view device_id, double temp_threshold, double moisture_threshold, std::string_view request_id) {
+    Json::Value root;
+    root["command"] = "update_threshold";
+    root["device_id"] = json_string(device_id);
+    root["temp_threshold"] = temp_threshold;
+    root["moisture_threshold"] = moisture_threshold;
+    root["request_id"] = json_string(request_id);
+    
+    return Json::writeString(json_writer(), root);
+}
+
+// 二进制消息中的字符串：u16小端长度 + 内容
+void append_binary_string(std::string& out, std::string_view s) {
+    uint16_t len = std::min<size_t>(s.size(), UINT16_MAX);
+    out.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    out.append(s.data(), len);
+}
+
+std::string binary_ack(std::string_view device_id, std::string_view status, std::string_view request_id) {
+    std::string out(1, (char)BIN_ACK);
+    append_binary_string(out, device_id);
+    append_binary_string(out, status);
+    append_binary_string(out, request_id);
+    return out;
+}
+
+std::string binary_data_response(std::string_view device_id, const DeviceData& data) {
+    std::string out(1, (char)BIN_DATA_RESPONSE);
+    append_binary_string(out, device_id);
+    size_t offset = out.size();
+    out.resize(offset + DEVICE_DATA_BYTES);
+    pack_device_data(&out[offset], data);
+    return out;
+}
+
+std::string binary_update_threshold(std::string_view device_id, double temp_threshold, double moisture_threshold, std::string_view request_id) {
+    std::string out(1, (char)BIN_UPDATE_THRESHOLD);
+    append_binary_string(out, device_id);
+    out.append(reinterpret_cast<const char*>(&temp_threshold), sizeof(double));
+    out.append(reinterpret_cast<const char*>(&moisture_threshold), sizeof(double));
+    append_binary_string(out, request_id);
+    return out;
+}
+
+// 按连接协商的编码生成ack和阈值更新。MQTT连接没有ack（QoS 1由PUBACK确认），
+// 阈值更新以JSON为内容发布到devices/<device_id>/threshold
+std::string encode_ack(const Connection& conn, std::string_view device_id, std::string_view status, std::string_view request_id = {}) {
+    if (conn.framer.mode == FRAME_MQTT) {
+        return {};
+    }
+    return conn.binary ? binary_ack(device_id, status, request_id) : create_ack(device_id, status, request_id);
+}
+
+std::string encode_update_threshold(const Connection& conn, std::string_view device_id, double temp_threshold,
+                                    double moisture_threshold, std::string_view request_id) {
+    if (conn.framer.mode == FRAME_MQTT) {
+        return mqtt_publish(mqtt_device_topic(device_id, "threshold"),
+                            create_update_threshold(device_id, temp_threshold, moisture_threshold, request_id));
+    }
+    return conn.binary ? binary_update_threshold(device_id, temp_threshold, moisture_threshold, request_id)
+                       : create_update_threshold(device_id, temp_threshold, moisture_threshold, request_id);
+}
+
+// 按帧格式封装一条消息
+std::string frame_message(uint8_t mode, const std::string& message) {
+    std::string frame;
+    if (mode == FRAME_LENGTH_PREFIXED) {
+        uint32_t len = message.size();
+        frame.reserve(4 + message.size());
+        frame.push_back((char)(len >> 24));
+        frame.push_back((char)(len >> 16));
+        frame.push_back((char)(len >> 8));
+        frame.push_back((char)len);
+        frame += message;
+    } else if (mode == FRAME_WEBSOCKET) {
+        frame = websocket_frame(WS_TEXT, message);
+    } else if (mode == FRAME_MQTT) {
+        frame = message; // 已由encode_update_threshold封装成PUBLISH
+    } else {
+        frame.reserve(message.size() + 1);
+        frame += message;
+        frame.push_back('\n');
+    }
+    return frame;
+}
+
+// CRC32（IEEE多项式），用于校验WAL和快照中的每条记录
+uint32_t crc32(const char* data, size_t len) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+enum WalRecordType : uint8_t {
+    WAL_UPLOAD = 1,      // 设备上报的完整数据
+    WAL_THRESHOLDS = 2   // 监控端设置的阈值
+};
+
+// 设备状态的预写日志。修改设备表时在分片锁内把记录追加到该分片自己的缓冲区，不同分片互不争用；
+// 后台线程收集各缓冲区后按批写盘并fdatasync（组提交）。同一设备的记录总在同一缓冲区，顺序不变；
+// WAL超过WAL_SNAPSHOT_BYTES时换新文件并写一份全量快照，旧文件随之删除。
+// 记录格式：u32正文长度 | u32正文CRC32 | 正文（u8类型 | u16 device_id长度 | device_id | 数据）
+class WriteAheadLog {
+public:
+    static constexpr uint32_t SNAPSHOT_MAGIC = 0x53544f49;   // "IOTS"
+    static constexpr uint32_t SNAPSHOT_VERSION = 1;
+    static constexpr size_t SNAPSHOT_HEADER_SIZE = 16;
+    
+    using SnapshotSource = std::function<std::vector<std::pair<std::string, DeviceData>>()>;
+    
+    ~WriteAheadLog() {
+        // main出错提前返回时也要结束后台线程，否则销毁可join的std::thread会terminate
+        stop();
+    }
+    
+    bool enabled() const { return active; }
+    
+    // 等待下一次组提交的字节数，不加锁读取
+    size_t queued_bytes() const { return queued.load(std::memory_order_relaxed); }
+    
+    // 以generation号开始写：先写一份快照再打开新的WAL文件，并删除更早的WAL
+    bool start(const std::string& data_dir, uint64_t generation, SnapshotSource source) {
+        dir = data_dir;
+        snapshot_source = std::move(source);
+        if (!write_snapshot(generation) || !open_segment(generation)) {
+            return false;
+        }
+        remove_segments_before(generation);
+        active = true;
+        writer = std::thread(&WriteAheadLog::writer_loop, this);
+        return true;
+    }
+    
+    // shard为设备所在的设备表分片，调用方须持有该分片的写锁
+    void log_upload(size_t shard, std::string_view device_id, const DeviceData& data) {
+        char payload[DEVICE_DATA_BYTES];
+        pack_device_data(payload, data);
+        append(shard, WAL_UPLOAD, device_id, payload, sizeof(payload));
+    }
+    
+    void log_thresholds(size_t shard, std::string_view device_id, double temp_threshold, double moisture_threshold) {
+        char payload[2 * sizeof(double)];
+        memcpy(payload, &temp_threshold, sizeof(double));
+        memcpy(payload + 8, &moisture_threshold, sizeof(double));
+        append(shard, WAL_THRESHOLDS, device_id, payload, sizeof(payload));
+    }
+    
+    // 写完剩余记录后停止
+    void stop() {
+        if (!active) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            active = false;
+        }
+        wake.notify_one();
+        writer.join();
+        close(fd);
+    }
+    
+    // 依次解析data中的记录，返回校验通过的前缀长度；遇到残缺或损坏的记录即停止
+    template <typename Visitor>
+    static size_t parse(const char* data, size_t len, Visitor&& visit) {
+        size_t pos = 0;
+        while (len - pos >= 8) {
+            uint32_t body_len;
+            uint32_t crc;
+            memcpy(&body_len, data + pos, 4);
+            memcpy(&crc, data + pos + 4, 4);
+            if (body_len < 3 || body_len > len - pos - 8) {
+                break;
+            }
+            const char* body = data + pos + 8;
+            if (crc32(body, body_len) != crc) {
+                break;
+            }
+            uint16_t id_len;
+            memcpy(&id_len, body + 1, 2);
+            if (3u + id_len > body_len) {
+                break;
+            }
+            visit((uint8_t)body[0], std::string_view(body + 3, id_len), body + 3 + id_len, body_len - 3 - id_len);
+            pos += 8 + body_len;
+        }
+        return pos;
+    }
+    
+    static std::string segment_path(const std::string& dir, uint64_t generation) {
+        return dir + "/wal." + std::to_string(generation);
+    }
+    
+    static std::string snapshot_path(const std::string& dir) {
+        return dir + "/snapshot.bin";
+    }
+    
+    // 文件名形如wal.<generation>
+    static bool parse_segment_name(const char* name, uint64_t& generation) {
+        if (strncmp(name, "wal.", 4) != 0) {
+            return false;
+        }
+        const char* digits = name + 4;
+        auto result = std::from_chars(digits, digits + strlen(digits), generation);
+        return result.ec == std::errc() && *result.ptr == '\0' && result.ptr != digits;
+    }
+    
+private:
+    static void encode(std::string& out, uint8_t type, std::string_view device_id, const char* payload, size_t n) {
+        uint32_t body_len = 3 + device_id.size() + n;
+        uint16_t id_len = device_id.size();
+        size_t start = out.size();
+        out.resize(start + 8 + body_len);
+        char* body = &out[start + 8];
+        body[0] = type;
+        memcpy(body + 1, &id_len, 2);
+        memcpy(body + 3, device_id.data(), device_id.size());
+        memcpy(body + 3 + device_id.size(), payload, n);
+        uint32_t crc = crc32(body, body_len);
+        memcpy(&out[start], &body_len, 4);
+        memcpy(&out[start + 4], &crc, 4);
+    }
+    
+    // 缓冲区的锁只与后台线程取走记录时争用；同分片的写入方已由分片锁串行
+    void append(size_t shard, uint8_t type, std::string_view device_id, const char* payload, size_t n) {
+        ShardBuffer& buffer = buffers[shard];
+        size_t before;
+        {
+            std::lock_guard<std::mutex> lock(buffer.mutex);
+            size_t start = buffer.pending.size();
+            encode(buffer.pending, type, device_id, payload, n);
+            before = queued.fetch_add(buffer.pending.size() - start, std::memory_order_relaxed);
+        }
+        // 不持有后台线程的锁通知，偶尔丢失的唤醒最多推迟一个组提交间隔
+        if (before == 0) {
+            wake.notify_one();
+        }
+    }
+    
+    bool open_segment(uint64_t generation) {
+        int new_fd = open(segment_path(dir, generation).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (new_fd < 0) {
+            LOG(LOG_ERROR) << "Failed to open WAL segment: " << strerror(errno);
+            return false;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = new_fd;
+        segment_generation = generation;
+        segment_bytes = 0;
+        return true;
+    }
+    
+    // 快照先写临时文件再rename，任何时刻磁盘上都有一份完整的快照
+    bool write_snapshot(uint64_t generation) {
+        std::string contents;
+        uint32_t header[2] = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION};
+        contents.append(reinterpret_cast<const char*>(header), sizeof(header));
+        contents.append(reinterpret_cast<const char*>(&generation), sizeof(generation));
+        auto devices = snapshot_source();
+        for (const auto& device : devices) {
+            char payload[DEVICE_DATA_BYTES];
+            pack_device_data(payload, device.second);
+            encode(contents, WAL_UPLOAD, device.first, payload, sizeof(payload));
+        }
+        
+        std::string path = snapshot_path(dir);
+        std::string tmp = path + ".tmp";
+        int snapshot_fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = snapshot_fd >= 0 && write_all(snapshot_fd, contents.data(), contents.size()) && fsync(snapshot_fd) == 0;
+        if (snapshot_fd >= 0) {
+            close(snapshot_fd);
+        }
+        ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+        if (!ok) {
+            LOG(LOG_ERROR) << "Failed to write snapshot: " << strerror(errno);
+            return false;
+        }
+        int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+        LOG(LOG_INFO) << "Wrote snapshot generation " << generation << " with " << devices.size() << " devices";
+        return true;
+    }
+    
+    void remove_segments_before(uint64_t generation) {
+        DIR* d = opendir(dir.c_str());
+        if (!d) {
+            return;
+        }
+        while (dirent* entry = readdir(d)) {
+            uint64_t segment;
+            if (parse_segment_name(entry->d_name, segment) && segment < generation) {
+                unlink(segment_path(dir, segment).c_str());
+            }
+        }
+        closedir(d);
+    }
+    
+    // 换到新的WAL文件后再取快照：快照之后的修改都在新文件里，重放它们是幂等的
+    void rotate() {
+        uint64_t next = segment_generation + 1;
+        if (open_segment(next) && write_snapshot(next)) {
+            remove_segments_before(next);
+        }
+    }
+    
+    void writer_loop() {
+        std::string batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait_for(lock, std::chrono::milliseconds(WAL_COMMIT_INTERVAL_MS), [&] {
+                    return queued.load(std::memory_order_relaxed) > 0 || !active;
+                });
+                // stop时I/O线程已退出，不会再有新记录
+                if (!active && queued.load(std::memory_order_relaxed) == 0) {
+                    break;
+                }
+            }
+            for (ShardBuffer& buffer : buffers) {
+                std::lock_guard<std::mutex> lock(buffer.mutex);
+                batch += buffer.pending;
+                buffer.pending.clear();
+            }
+            if (batch.empty()) {
+                continue;
+            }
+            queued.fetch_sub(batch.size(), std::memory_order_relaxed);
+            
+            // 一次write加一次fdatasync提交这段时间内积累的全部记录
+            if (!write_all(fd, batch.data(), batch.size()) || fdatasync(fd) != 0) {
+                LOG(LOG_ERROR) << "WAL write failed: " << strerror(errno);
+            }
+            segment_bytes += batch.size();
+            batch.clear();
+            if (segment_bytes >= WAL_SNAPSHOT_BYTES) {
+                rotate();
+            }
+        }
+    }
+    
+    // 每个设备表分片一个，避免伪共享
+    struct alignas(64) ShardBuffer {
+        std::mutex mutex;
+        std::string pending;         // 等待下一次组提交的记录
+    };
+    
+    std::string dir;
+    SnapshotSource snapshot_source;
+    bool active = false;             // 启动后只在stop时修改，此时I/O线程已退出
+    int fd = -1;                     // 以下三项启动后只由后台线程访问
+    uint64_t segment_generation = 0;
+    size_t segment_bytes = 0;
+    std::mutex mutex;                // 只用于后台线程等待唤醒
+    std::condition_variable wake;
+    std::array<ShardBuffer, DEVICE_SHARDS> buffers;
+    std::atomic<size_t> queued{0};   // 各缓冲区中记录的总字节数
+    std::thread writer;
+};
+
+WriteAheadLog wal;
+
+// 按device_id哈希分片的设备表，每个分片一把读写锁，不同设备的上报和查询互不阻塞
+class DeviceStore {
+public:
+    // 写入设备上报的数据，同时记入历史
+    void upload(std::string_view device_id, const DeviceData& data) {
+        HistorySample sample{now_ms(), data.temperature, data.soil_moisture};
+        size_t index = shard_index(device_id);
+        Shard& shard = shards[index];
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.devices.find(device_id);
+        if (it != shard.devices.end()) {
+            it->second.data = data;
+            bump_version(it->second);
+        } else {
+            it = shard.devices.emplace(std::string(device_id), DeviceEntry()).first;
+            it->second.data = data;
+        }
+        it->second.history.append(sample);
+        // 在分片锁内记日志，同一设备的WAL记录顺序与修改顺序一致
+        if (wal.enabled()) {
+            wal.log_upload(index, device_id, data);
+        }
+    }
+    
+    // 批量写入：按(分片, device_id)排序后每个分片只加一次写锁，每个设备只更新一次版本、记一条WAL，
+    // 采样逐条记入历史，同一设备的采样保持原有顺序。updated返回更新过的设备（去重）
+    void upload_batch(const std::vector<BatchSample>& samples, int64_t received_at, std::vector<std::string_view>& updated) {
+        std::vector<std::pair<size_t, uint32_t>> order; // (分片, 采样下标)
+        order.reserve(samples.size());
+        for (uint32_t i = 0; i < samples.size(); ++i) {
+            order.emplace_back(shard_index(samples[i].device_id), i);
+        }
+        std::stable_sort(order.begin(), order.end(), [&](const auto& a, const auto& b) {
+            return a.first != b.first ? a.first < b.first : samples[a.second].device_id < samples[b.second].device_id;
+        });
+        
+        size_t next = 0;
+        while (next < order.size()) {
+            size_t index = order[next].first;
+            Shard& shard = shards[index];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            while (next < order.size() && order[next].first == index) {
+                std::string_view device_id = samples[order[next].second].device_id;
+                auto it = shard.devices.find(device_id);
+                if (it == shard.devices.end()) {
+                    it = shard.devices.emplace(std::string(device_id), DeviceEntry()).first;
+                }
+                DeviceEntry& entry = it->second;
+                for (; next < order.size() && samples[order[next].second].device_id == device_id; ++next) {
+                    const BatchSample& sample = samples[order[next].second];
+                    entry.data = sample.data;
+                    entry.history.append({sample.timestamp > 0 ? sample.timestamp : received_at,
+                                          sample.data.temperature, sample.data.soil_moisture});
+                }
+                bump_version(entry);
+                if (wal.enabled()) {
+                    wal.log_upload(index, device_id, entry.data);
+                }
+                updated.push_back(device_id);
+            }
+        }
+    }
+    
+    // 从快照或WAL恢复设备数据，不写WAL也不记历史
+    void restore(std::string_view device_id, const DeviceData& data) {
+        Shard& shard = shard_for(device_id);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.devices.find(device_id);
+        if (it == shard.devices.end()) {
+            it = shard.devices.emplace(std::string(device_id), DeviceEntry()).first;
+        }
+        it->second.data = data;
+        bump_version(it->second);
+    }
+    
+    // 取设备在[from, to]内的历史采样，设备不存在时返回false
+    bool history(std::string_view device_id, int64_t from, int64_t to, std::vector<HistorySample>& out) {
+        Shard& shard = shard_for(device_id);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.devices.find(device_id);
+        if (it == shard.devices.end()) {
+            return false;
+        }
+        it->second.history.query(from, to, out);
+        return true;
+    }
+    
+    // 所有设备的历史采样总数和占用的内存
+    void history_stats(size_t& samples, size_t& bytes) {
+        samples = bytes = 0;
+        for (Shard& shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for (const auto& device : shard.devices) {
+                samples += device.second.history.size();
+                bytes += device.second.history.memory_bytes();
+            }
+        }
+    }
+    
+    // 更新阈值，设备不存在时返回false
+    bool set_thresholds(std::string_view device_id, double temp_threshold, double moisture_threshold) {
+        size_t index = shard_index(device_id);
+        Shard& shard = shards[index];
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.devices.find(device_id);
+        if (it == shard.devices.end()) {
+            return false;
+        }
+        it->second.data.temp_threshold = temp_threshold;
+        it->second.data.moisture_threshold = moisture_threshold;
+        bump_version(it->second);
+        if (wal.enabled()) {
+            wal.log_thresholds(index, device_id, temp_threshold, moisture_threshold);
+        }
+        return true;
+    }
+    
+    // 取设备当前版本的data_response，设备不存在时返回空。
+    // 缓存命中只需读锁；渲染在锁外进行，期间数据若被更新则不写回缓存
+    std::shared_ptr<const RenderedResponse> data_response(std::string_view device_id) {
+        Shard& shard = shard_for(device_id);
+        DeviceData snapshot;
+        uint64_t version;
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.devices.find(device_id);
+            if (it == shard.devices.end()) {
+                return nullptr;
+            }
+            std::shared_ptr<const RenderedResponse> cached = std::atomic_load(&it->second.rendered);
+            if (cached) {
+                return cached;
+            }
+            snapshot = it->second.data;
+            version = it->second.version;
+        }
+        
+        return render_and_cache(shard, device_id, snapshot, version);
+    }
+    
+    // 一组设备同一时刻的data_response。涉及的分片按下标顺序同时加读锁后一次取完，
+    // 结果不会混入这期间的写入；已缓存的版本直接复用，其余在锁外渲染。
+    // prefix为true时取所有以keys[0]开头的设备（按device_id排序），否则按keys的顺序取，不存在的记入missing。
+    // 最多返回MAX_MULTI_DEVICES个设备，超出时truncated置true
+    std::vector<std::shared_ptr<const RenderedResponse>> data_responses(const std::vector<std::string_view>& keys, bool prefix,
+                                                                        std::vector<std::string_view>& missing, bool& truncated) {
+        struct Item {
+            std::string device_id;
+            DeviceData data;
+            uint64_t version;
+            std::shared_ptr<const RenderedResponse> rendered;
+        };
+        std::vector<Item> items;
+        truncated = false;
+        {
+            std::vector<size_t> indices;
+            if (prefix) {
+                for (size_t i = 0; i < DEVICE_SHARDS; ++i) {
+                    indices.push_back(i);
+                }
+            } else {
+                for (std::string_view key : keys) {
+                    indices.push_back(shard_index(key));
+                }
+                std::sort(indices.begin(), indices.end());
+                indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+            }
+            std::vector<std::shared_lock<std::shared_mutex>> locks;
+            locks.reserve(indices.size());
+            for (size_t index : indices) {
+                locks.emplace_back(shards[index].mutex);
+            }
+            
+            auto collect = [&](const std::string& device_id, const DeviceEntry& entry) {
+                items.push_back({device_id, entry.data, entry.version, std::atomic_load(&entry.rendered)});
+            };
+            if (prefix) {
+                std::string_view key = keys.empty() ? std::string_view() : keys[0];
+                for (Shard& shard : shards) {
+                    for (auto it = shard.devices.lower_bound(key);
+                         it != shard.devices.end() && it->first.compare(0, key.size(), key) == 0; ++it) {
+                        collect(it->first, it->second);
+                    }
+                }
+            } else {
+                for (std::string_view key : keys) {
+                    if (items.size() == MAX_MULTI_DEVICES) {
+                        truncated = true;
+                        break;
+                    }
+                    Shard& shard = shard_for(key);
+                    auto it = shard.devices.find(key);
+                    if (it != shard.devices.end()) {
+                        collect(it->first, it->second);
+                    } else {
+                        missing.push_back(key);
+                    }
+                }
+            }
+        }
+        
+        if (prefix) {
+            std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) { return a.device_id < b.device_id; });
+            if (items.size() > MAX_MULTI_DEVICES) {
+                items.resize(MAX_MULTI_DEVICES);
+                truncated = true;
+            }
+        }
+        std::vector<std::shared_ptr<const RenderedResponse>> responses;
+        responses.reserve(items.size());
+        for (Item& item : items) {
+            if (!item.rendered) {
+                item.rendered = render_and_cache(shard_for(item.device_id), item.device_id, item.data, item.version);
+            }
+            responses.push_back(std::move(item.rendered));
+        }
+        return responses;
+    }
+    
+    // 所有设备数据的副本，按device_id排序
+    std::vector<std::pair<std::string, DeviceData>> snapshot() {
+        std::vector<std::pair<std::string, DeviceData>> devices;
+        for (Shard& shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for (const auto& device : shard.devices) {
+                devices.emplace_back(device.first, device.second.data);
+            }
+        }
+        std::sort(devices.begin(), devices.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        return devices;
+    }
+    
+private:
+    struct alignas(64) Shard {
+        std::shared_mutex mutex;
+        std::map<std::string, DeviceEntry, std::less<>> devices;
+    };
+    
+    static size_t shard_index(std::string_view device_id) {
+        return std::hash<std::string_view>()(device_id) % DEVICE_SHARDS;
+    }
+    
+    Shard& shard_for(std::string_view device_id) {
+        return shards[shard_index(device_id)];
+    }
+    
+    // 在锁外渲染某一版本的数据，数据在此期间未变时写回缓存
+    std::shared_ptr<const RenderedResponse> render_and_cache(Shard& shard, std::string_view device_id,
+                                                             const DeviceData& data, uint64_t version) {
+        auto rendered = std::make_shared<RenderedResponse>();
+        rendered->version = version;
+        rendered->body = render_data_response(device_id, data);
+        rendered->newline_frame = frame_message(FRAME_NEWLINE, rendered->body);
+        rendered->length_prefixed_frame = frame_message(FRAME_LENGTH_PREFIXED, rendered->body);
+        rendered->websocket_frame = frame_message(FRAME_WEBSOCKET, rendered->body);
+        rendered->mqtt_frame = mqtt_publish(mqtt_device_topic(device_id, "data"), rendered->body);
+        rendered->binary_frame = frame_message(FRAME_LENGTH_PREFIXED, binary_data_response(device_id, data));
+        
+        // 版本只在写锁下改变，持读锁比较后写入不会覆盖新版本
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.devices.find(device_id);
+        if (it != shard.devices.end() && it->second.version == version) {
+            std::atomic_store(&it->second.rendered, std::shared_ptr<const RenderedResponse>(rendered));
+        }
+        return rendered;
+    }
+    
+    // 修改设备数据后调用（需持有分片写锁），使缓存的响应失效
+    static void bump_version(DeviceEntry& entry) {
+        ++entry.version;
+        std::atomic_store(&entry.rendered, std::shared_ptr<const RenderedResponse>());
+    }
+    
+    Shard shards[DEVICE_SHARDS];
+};
+
+DeviceStore device_store;
+
+// 只读映射整个文件交给visit，文件不存在或为空时返回false
+template <typename Visitor>
+bool map_file(const std::string& path, Visitor&& visit) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && st.st_size > 0;
+    void* data = ok ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    visit(static_cast<const char*>(data), (size_t)st.st_size);
+    munmap(data, st.st_size);
+    return true;
+}
+
+// 启动时用最新快照加上其后的WAL恢复设备表，并给出下一个可用的generation
+bool recover_device_state(const std::string& dir, uint64_t& next_generation) {
+    auto started = std::chrono::steady_clock::now();
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        LOG(LOG_ERROR) << "Failed to create data directory " << dir << ": " << strerror(errno);
+        return false;
+    }
+    
+    size_t records = 0;
+    auto apply = [&](uint8_t type, std::string_view device_id, const char* payload, size_t len) {
+        if (type == WAL_UPLOAD && len == DEVICE_DATA_BYTES) {
+            DeviceData data;
+            unpack_device_data(payload, data);
+            device_store.restore(device_id, data);
+        } else if (type == WAL_THRESHOLDS && len == 2 * sizeof(double)) {
+            double temp_threshold;
+            double moisture_threshold;
+            memcpy(&temp_threshold, payload, sizeof(double));
+            memcpy(&moisture_threshold, payload + 8, sizeof(double));
+            device_store.set_thresholds(device_id, temp_threshold, moisture_threshold);
+        }
+        ++records;
+    };
+    
+    uint64_t snapshot_generation = 0;
+    map_file(WriteAheadLog::snapshot_path(dir), [&](const char* data, size_t len) {
+        uint32_t header[2];
+        if (len < WriteAheadLog::SNAPSHOT_HEADER_SIZE) {
+            return;
+        }
+        memcpy(header, data, sizeof(header));
+        if (header[0] != WriteAheadLog::SNAPSHOT_MAGIC || header[1] != WriteAheadLog::SNAPSHOT_VERSION) {
+            LOG(LOG_WARN) << "Ignoring snapshot with unknown format";
+            return;
+        }
+        memcpy(&snapshot_generation, data + 8, sizeof(snapshot_generation));
+        WriteAheadLog::parse(data + WriteAheadLog::SNAPSHOT_HEADER_SIZE, len - WriteAheadLog::SNAPSHOT_HEADER_SIZE, apply);
+    });
+    size_t snapshot_records = records;
+    
+    // 只重放快照之后（generation不小于快照）的WAL，按generation顺序
+    std::vector<uint64_t> segments;
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* entry = readdir(d)) {
+            uint64_t generation;
+            if (WriteAheadLog::parse_segment_name(entry->d_name, generation) && generation >= snapshot_generation) {
+                segments.push_back(generation);
+            }
+        }
+        closedir(d);
+    }
+    std::sort(segments.begin(), segments.end());
+    for (uint64_t generation : segments) {
+        map_file(WriteAheadLog::segment_path(dir, generation), [&](const char* data, size_t len) {
+            size_t valid = WriteAheadLog::parse(data, len, apply);
+            if (valid < len) {
+                LOG(LOG_WARN) << "WAL segment " << generation << " has " << (len - valid) << " trailing bytes of incomplete records";
+            }
+        });
+    }
+    
+    next_generation = std::max(snapshot_generation, segments.empty() ? 0 : segments.back()) + 1;
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+    LOG(LOG_INFO) << "Recovered " << snapshot_records << " devices from snapshot and " << (records - snapshot_records)
+                  << " WAL records in " << elapsed / 1000.0 << " ms";
+    return true;
+}
+
+// 订阅索引：精确订阅按device_id查找，前缀订阅按device_id的每个前缀查找，
+// 一次上报只触达关心该设备的连接
+class SubscriptionIndex {
+public:
+    // 返回false表示已经订阅过
+    bool subscribe(const std::shared_ptr<Connection>& conn, std::string_view key, bool prefix) {
+        auto& table = prefix ? prefixes : exact;
+        {
+            // 轮询的监控端每次get_data都会走到这里，已订阅时只加读锁，不阻塞推送
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto it = table.find(key);
+            if (it != table.end() && it->second.count(conn->id)) {
+                return false;
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = table.find(key);
+        if (it == table.end()) {
+            it = table.emplace(std::string(key), Subscribers()).first;
+        }
+        if (!it->second.emplace(conn->id, conn).second) {
+            return false;
+        }
+        topics_by_connection[conn->id].push_back({std::string(key), prefix});
+        return true;
+    }
+    
+    // 返回false表示并未订阅
+    bool unsubscribe(const Connection& conn, std::string_view key, bool prefix) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        if (!erase(conn.id, key, prefix)) {
+            return false;
+        }
+        auto& topics = topics_by_connection[conn.id];
+        topics.erase(std::find_if(topics.begin(), topics.end(), [&](const Topic& topic) {
+            return topic.prefix == prefix && topic.key == key;
+        }));
+        if (topics.empty()) {
+            topics_by_connection.erase(conn.id);
+        }
+        return true;
+    }
+    
+    // 连接断开时清除它的全部订阅
+    void remove(const Connection& conn) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = topics_by_connection.find(conn.id);
+        if (it == topics_by_connection.end()) {
+            return;
+        }
+        for (const Topic& topic : it->second) {
+            erase(conn.id, topic.key, topic.prefix);
+        }
+        topics_by_connection.erase(it);
+    }
+    
+    // 订阅了device_id的连接，精确与前缀订阅重叠时只出现一次
+    std::vector<std::shared_ptr<Connection>> subscribers(std::string_view device_id) {
+        std::vector<std::shared_ptr<Connection>> result;
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto collect = [&](const std::map<std::string, Subscribers, std::less<>>& table, std::string_view key) {
+            auto it = table.find(key);
+            if (it == table.end()) {
+                return;
+            }
+            for (const auto& subscriber : it->second) {
+                if (auto conn = subscriber.second.lock()) {
+                    result.push_back(std::move(conn));
+                }
+            }
+        };
+        collect(exact, device_id);
+        if (!prefixes.empty()) {
+            for (size_t len = 0; len <= device_id.size(); ++len) {
+                collect(prefixes, device_id.substr(0, len));
+            }
+            std::sort(result.begin(), result.end());
+            result.erase(std::unique(result.begin(), result.end()), result.end());
+        }
+        return result;
+    }
+    
+private:
+    using Subscribers = std::map<uint64_t, std::weak_ptr<Connection>>; // connection id -> 连接
+    
+    struct Topic {
+        std::string key;
+        bool prefix;
+    };
+    
+    bool erase(uint64_t conn_id, std::string_view key, bool prefix) {
+        auto& table = prefix ? prefixes : exact;
+        auto it = table.find(key);
+        if (it == table.end() || it->second.erase(conn_id) == 0) {
+            return false;
+        }
+        if (it->second.empty()) {
+            table.erase(it);
+        }
+        return true;
+    }
+    
+    std::shared_mutex mutex;
+    std::map<std::string, Subscribers, std::less<>> exact;
+    std::map<std::string, Subscribers, std::less<>> prefixes;
+    std::unordered_map<uint64_t, std::vector<Topic>> topics_by_connection;
+};
+
+SubscriptionIndex subscriptions;
+
+void send_to_client(const std::shared_ptr<Connection>& conn, const std::string& message) {
+    // encode_ack对MQTT连接返回空串
+    if (message.empty()) {
+        return;
+    }
+    io_engine->send(conn, frame_message(conn->framer.mode, message));
+}
+
+// 把设备的最新数据推送给订阅了它的客户端，共用同一份渲染结果
+void broadcast_data_response(std::string_view device_id) {
+    std::vector<std::shared_ptr<Connection>> pcs = subscriptions.subscribers(device_id);
+    thread_stats.local().fanout.record(pcs.size());
+    if (pcs.empty()) {
+        return;
+    }
+    std::shared_ptr<const RenderedResponse> response = device_store.data_response(device_id);
+    if (!response) {
+        return;
+    }
+    for (const auto& pc : pcs) {
+        io_engine->publish(pc, device_id, response);
+    }
+}
+
+// 第一阶段：按64字节块用SIMD找出所有结构字符（{}[]:, 以及引号）的位置，
+// 字符串内部的字符用引号掩码的前缀异或排除
+struct StructuralIndex {
+    uint32_t pos[MAX_STRUCTURALS];
+    size_t count = 0;
+};
+
+inline uint64_t prefix_xor(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+// 各指令集版本共用：把一个块的字符掩码转换成结构字符下标，in_string携带跨块的字符串状态
+inline bool emit_structurals(uint64_t quotes, uint64_t backslashes, uint64_t ops, uint32_t base,
+                             uint64_t& in_string, StructuralIndex& index) {
+    if (backslashes) {
+        return false; // 含转义的帧交给jsoncpp
+    }
+    uint64_t string_mask = prefix_xor(quotes) ^ in_string;
+    in_string = (uint64_t)((int64_t)string_mask >> 63);
+    uint64_t structurals = (ops & ~string_mask) | quotes;
+    while (structurals) {
+        if (index.count == MAX_STRUCTURALS) {
+            return false;
+        }
+        index.pos[index.count++] = base + __builtin_ctzll(structurals);
+        structurals &= structurals - 1;
+    }
+    return true;
+}
+
+// '['和'{'、']'和'}'只差0x20这一位
+void classify_scalar(const char* block, uint64_t& quotes, uint64_t& backslashes, uint64_t& ops) {
+    quotes = backslashes = ops = 0;
+    for (int i = 0; i < 64; ++i) {
+        char c = block[i];
+        char folded = c | 0x20;
+        quotes |= (uint64_t)(c == '"') << i;
+        backslashes |= (uint64_t)(c == '\\') << i;
+        ops |= (uint64_t)(folded == '{' || folded == '}' || c == ':' || c == ',') << i;
+    }
+}
+
+bool scan_structurals_scalar(const char* data, size_t len, StructuralIndex& index) {
+    uint64_t quotes, backslashes, ops, in_string = 0;
+    size_t pos = 0;
+    for (; pos + 64 <= len; pos += 64) {
+        classify_scalar(data + pos, quotes, backslashes, ops);
+        if (!emit_structurals(quotes, backslashes, ops, pos, in_string, index)) {
+            return false;
+        }
+    }
+    if (pos < len) {
+        char tail[64] = {0};
+        memcpy(tail, data + pos, len - pos);
+        classify_scalar(tail, quotes, backslashes, ops);
+        if (!emit_structurals(quotes, backslashes, ops, pos, in_string, index)) {
+            return false;
+        }
+    }
+    return in_string == 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+inline void classify_avx2(const char* block, uint64_t& quotes, uint64_t& backslashes, uint64_t& ops) {
+    quotes = backslashes = ops = 0;
+    for (int half = 0; half < 2; ++half) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + half * 32));
+        __m256i folded = _mm256_or_si256(chunk, _mm256_set1_epi8(0x20));
+        __m256i brackets = _mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')),
+                                           _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}')));
+        __m256i separators = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(':')),
+                                             _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(',')));
+        int shift = half * 32;
+        quotes |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('"'))) << shift;
+        backslashes |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\\'))) << shift;
+        ops |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(brackets, separators)) << shift;
+    }
+}
+
+__attribute__((target("avx2")))
+bool scan_structurals_avx2(const char* data, size_t len, StructuralIndex& index) {
+    uint64_t quotes, backslashes, ops, in_string = 0;
+    size_t pos = 0;
+    for (; pos + 64 <= len; pos += 64) {
+        classify_avx2(data + pos, quotes, backslashes, ops);
+        if (!emit_structurals(quotes, backslashes, ops, pos, in_string, index)) {
+            return false;
+        }
+    }
+    if (pos < len) {
+        alignas(32) char tail[64] = {0};
+        memcpy(tail, data + pos, len - pos);
+        classify_avx2(tail, quotes, backslashes, ops);
+        if (!emit_structurals(quotes, backslashes, ops, pos, in_string, index)) {
+            return false;
+        }
+    }
+    return in_string == 0;
+}
+
+// SSE4.2：结构字符集合用PCMPESTRM一次比较
+__attribute__((target("sse4.2")))
+inline void classify_sse42(const char* block, uint64_t& quotes, uint64_t& backslashes, uint64_t& ops) {
+    const __m128i operator_set = _mm_setr_epi8('{', '}', '[', ']', ':', ',', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    quotes = backslashes = ops = 0;
+    for (int quarter = 0; quarter < 4; ++quarter) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + quarter * 16));
+        __m128i matched = _mm_cmpestrm(operator_set, 6, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+        int shift = quarter * 16;
+        quotes |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('"'))) << shift;
+        backslashes |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\'))) << shift;
+        ops |= (uint64_t)(uint16_t)_mm_cvtsi128_si32(matched) << shift;
+    }
+}
+
+__attribute__((target("sse4.2")))
+bool scan_structurals_sse42(const char* data, size_t len, StructuralIndex& index) {
+    uint64_t quotes, backslashes, ops, in_string = 0;
+    size_t pos = 0;
+    for (; pos + 64 <= len; pos += 64) {
+        classify_sse42(data + pos, quotes, backslashes, ops);
+        if (!emit_structurals(quotes, backslashes, ops, pos, in_string, index)) {
+            return false;
+        }
+    }
+    if (pos < len) {
+        alignas(16) char tail[64] = {0};
+        memcpy(tail, data + pos, len - pos);
+        classify_sse42(tail, quotes, backslashes, ops);
+        if (!emit_structurals(quotes, backslashes, ops, pos, in_string, index)) {
+            return false;
+        }
+    }
+    return in_string == 0;
+}
+#endif
+
+struct StructuralScanner {
+    const char* name;
+    bool (*scan)(const char* data, size_t len, StructuralIndex& index);
+};
+
+// 启动时按CPU支持的指令集选择一次
+StructuralScanner select_structural_scanner() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", scan_structurals_avx2};
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return {"sse4.2", scan_structurals_sse42};
+    }
+#endif
+    return {"scalar", scan_structurals_scalar};
+}
+
+const StructuralScanner structural_scanner = select_structural_scanner();
+
+const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// 解析一个JSON数字。尾数不超过2^53且十进制指数在±22以内时一次乘除即可得到
+// 正确舍入的结果（Clinger快速路径），其余情况交给from_chars
+bool parse_number(const char* begin, const char* end, double& out, const char*& stop) {
+    const char* p = begin;
+    bool negative = p < end && *p == '-';
+    if (negative) {
+        ++p;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        return false;
+    }
+    
+    uint64_t mantissa = 0;
+    int significant = 0;
+    int exponent = 0;
+    bool truncated = false;
+    auto add_digit = [&](int digit, bool fraction) {
+        if (significant < 19) {
+            mantissa = mantissa * 10 + digit;
+            significant += (mantissa != 0);
+            exponent -= fraction;
+        } else {
+            truncated = true;
+            exponent += !fraction;
+        }
+    };
+    
+    if (*p == '0') {
+        ++p;
+    } else {
+        while (p < end && *p >= '0' && *p <= '9') {
+            add_digit(*p++ - '0', false);
+        }
+    }
+    if (p < end && *p == '.') {
+        ++p;
+        if (p == end || *p < '0' || *p > '9') {
+            return false;
+        }
+        while (p < end && *p >= '0' && *p <= '9') {
+            add_digit(*p++ - '0', true);
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool negative_exp = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+')) {
+            ++p;
+        }
+        if (p == end || *p < '0' || *p > '9') {
+            return false;
+        }
+        int exp_value = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            exp_value = std::min(exp_value * 10 + (*p++ - '0'), 100000);
+        }
+        exponent += negative_exp ? -exp_value : exp_value;
+    }
+    stop = p;
+    
+    if (!truncated && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        double value = (double)mantissa;
+        value = exponent < 0 ? value / exact_powers_of_ten[-exponent] : value * exact_powers_of_ten[exponent];
+        out = negative ? -value : value;
+        return true;
+    }
+    auto result = std::from_chars(begin, p, out);
+    return result.ec == std::errc() && result.ptr == p;
+}
+
+// 第二阶段：沿结构字符下标解码。标量值就是两个结构字符之间的文本，
+// 其余间隙只允许是空白
+class StructuralWalker {
+public:
+    StructuralWalker(std::string_view text, const StructuralIndex& structurals)
+        : frame(text), index(structurals) {}
+        
+    bool at(char c) const {
+        return next < index.count && frame[index.pos[next]] == c;
+    }
+    
+    bool consume(char c) {
+        if (!at(c) || !blank(cursor, index.pos[next])) {
+            return false;
+        }
+        cursor = index.pos[next++] + 1;
+        return true;
+    }
+    
+    bool string(std::string_view& out) {
+        if (!consume('"') || next == index.count) {
+            return false;
+        }
+        uint32_t close = index.pos[next++];
+        out = frame.substr(cursor, close - cursor);
+        cursor = close + 1;
+        return true;
+    }
+    
+    bool number(double& out) {
+        std::string_view text = scalar();
+        const char* stop = nullptr;
+        return !text.empty() && parse_number(text.data(), text.data() + text.size(), out, stop)
+            && stop == text.data() + text.size();
+    }
+    
+    bool boolean(bool& out) {
+        std::string_view text = scalar();
+        out = text == "true";
+        return out || text == "false";
+    }
+    
+    // 跳过未知字段的值；嵌套的对象或数组视为未知结构
+    bool skip_value() {
+        if (at('"')) {
+            std::string_view text;
+            return string(text);
+        }
+        if (at('{') || at('[')) {
+            return false;
+        }
+        std::string_view text = scalar();
+        double value;
+        const char* stop = nullptr;
+        return text == "null" || text == "true" || text == "false"
+            || (!text.empty() && parse_number(text.data(), text.data() + text.size(), value, stop)
+                && stop == text.data() + text.size());
+    }
+    
+    bool finished() const {
+        return next == index.count && blank(cursor, frame.size());
+    }
+    
+private:
+    bool blank(size_t from, size_t to) const {
+        for (size_t i = from; i < to; ++i) {
+            char c = frame[i];
+            if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // 从当前位置到下一个结构字符之间去掉空白的文本
+    std::string_view scalar() {
+        size_t end = next < index.count ? index.pos[next] : frame.size();
+        size_t begin = cursor;
+        while (begin < end && isspace((unsigned char)frame[begin])) {
+            ++begin;
+        }
+        size_t stop = end;
+        while (stop > begin && isspace((unsigned char)frame[stop - 1])) {
+            --stop;
+        }
+        cursor = end;
+        return frame.substr(begin, stop - begin);
+    }
+    
+    std::string_view frame;
+    const StructuralIndex& index;
+    size_t next = 0;
+    size_t cursor = 0;
+};
+
+template <typename FieldHandler>
+bool parse_object(StructuralWalker& walker, FieldHandler&& on_field) {
+    if (!walker.consume('{')) {
+        return false;
+    }
+    if (walker.consume('}')) {
+        return true;
+    }
+    do {
+        std::string_view key;
+        if (!walker.string(key) || !walker.consume(':') || !on_field(key)) {
+            return false;
+        }
+    } while (walker.consume(','));
+    return walker.consume('}');
+}
+
+CommandType command_type(std::string_view command) {
+    if (command == "upload") {
+        return CMD_UPLOAD;
+    } else if (command == "get_data") {
+        return CMD_GET_DATA;
+    } else if (command == "set_threshold") {
+        return CMD_SET_THRESHOLD;
+    } else if (command == "ack") {
+        return CMD_ACK;
+    } else if (command == "subscribe") {
+        return CMD_SUBSCRIBE;
+    } else if (command == "unsubscribe") {
+        return CMD_UNSUBSCRIBE;
+    } else if (command == "get_history") {
+        return CMD_GET_HISTORY;
+    } else if (command == "upload_batch") {
+        return CMD_UPLOAD_BATCH;
+    } else if (command == "get_data_multi") {
+        return CMD_GET_DATA_MULTI;
+    } else if (command == "hello") {
+        return CMD_HELLO;
+    }
+    return CMD_UNKNOWN;
+}
+
+const char* command_name(CommandType type) {
+    static const char* const names[] = {
+        "unknown", "upload", "get_data", "set_threshold", "ack", "subscribe",
+        "unsubscribe", "get_history", "upload_batch", "get_data_multi", "hello"
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == CMD_HELLO + 1, "command_name out of sync with CommandType");
+    return names[type];
+}
+
+bool decode_device_data(StructuralWalker& walker, DeviceData& data) {
+    return parse_object(walker, [&](std::string_view key) {
+        if (key == "temperature") {
+            return walker.number(data.temperature);
+        } else if (key == "soil_moisture") {
+            return walker.number(data.soil_moisture);
+        } else if (key == "temp_threshold") {
+            return walker.number(data.temp_threshold);
+        } else if (key == "moisture_threshold") {
+            return walker.number(data.moisture_threshold);
+        } else if (key == "watering") {
+            return walker.boolean(data.watering);
+        }
+        return walker.skip_value();
+    });
+}
+
+bool decode_batch_samples(StructuralWalker& walker, std::vector<BatchSample>& samples) {
+    if (!walker.consume('[')) {
+        return false;
+    }
+    if (walker.consume(']')) {
+        return true;
+    }
+    do {
+        BatchSample& sample = samples.emplace_back();
+        double timestamp = 0;
+        bool ok = parse_object(walker, [&](std::string_view key) {
+            if (key == "device_id") {
+                return walker.string(sample.device_id);
+            } else if (key == "timestamp") {
+                return walker.number(timestamp);
+            } else if (key == "data") {
+                return decode_device_data(walker, sample.data);
+            }
+            return walker.skip_value();
+        });
+        if (!ok) {
+            return false;
+        }
+        sample.timestamp = timestamp_from_double(timestamp);
+    } while (walker.consume(','));
+    return walker.consume(']');
+}
+
+bool decode_string_array(StructuralWalker& walker, std::vector<std::string_view>& out) {
+    if (!walker.consume('[')) {
+        return false;
+    }
+    if (walker.consume(']')) {
+        return true;
+    }
+    do {
+        if (!walker.string(out.emplace_back())) {
+            return false;
+        }
+    } while (walker.consume(','));
+    return walker.consume(']');
+}
+
+// 快速路径：直接在接收缓冲区上解码upload/get_data/set_threshold/ack，除批量采样外不分配内存。
+// 结构不符合预期时返回false，由decode_message_jsoncpp兜底
+bool decode_message(std::string_view frame, Message& msg) {
+    msg = Message{};
+    // 索引较大，每个线程复用一份
+    thread_local StructuralIndex index;
+    index.count = 0;
+    if (!structural_scanner.scan(frame.data(), frame.size(), index)) {
+        return false;
+    }
+    
+    StructuralWalker walker(frame, index);
+    bool ok = parse_object(walker, [&](std::string_view key) {
+        if (key == "command") {
+            return walker.string(msg.command);
+        } else if (key == "device_id") {
+            return walker.string(msg.device_id);
+        } else if (key == "status") {
+            return walker.string(msg.status);
+        } else if (key == "request_id") {
+            return walker.string(msg.request_id);
+        } else if (key == "protocol") {
+            return walker.string(msg.protocol);
+        } else if (key == "temp_threshold") {
+            return walker.number(msg.temp_threshold);
+        } else if (key == "moisture_threshold") {
+            return walker.number(msg.moisture_threshold);
+        } else if (key == "from") {
+            return walker.number(msg.from);
+        } else if (key == "to") {
+            return walker.number(msg.to);
+        } else if (key == "data") {
+            return decode_device_data(walker, msg.data);
+        } else if (key == "samples") {
+            return decode_batch_samples(walker, msg.samples);
+        } else if (key == "device_ids") {
+            return decode_string_array(walker, msg.device_ids);
+        }
+        return walker.skip_value();
+    });
+    if (!ok || !walker.finished()) {
+        return false;
+    }
+    msg.type = command_type(msg.command);
+    return msg.type != CMD_UNKNOWN;
+}
+
+// 兜底解析时Message里各视图指向的存储
+struct JsonFallback {
+    Json::Value root;
+    std::string command;
+    std::string device_id;
+    std::string status;
+    std::string request_id;
+    std::string protocol;
+    std::vector<std::string> sample_device_ids;
+    std::vector<std::string> device_ids;
+};
+
+void read_device_data(const Json::Value& data_obj, DeviceData& data) {
+    data.temperature = data_obj["temperature"].asDouble();
+    data.soil_moisture = data_obj["soil_moisture"].asDouble();
+    data.temp_threshold = data_obj["temp_threshold"].asDouble();
+    data.moisture_threshold = data_obj["moisture_threshold"].asDouble();
+    data.watering = data_obj["watering"].asBool();
+}
+
+bool decode_message_jsoncpp(std::string_view frame, Message& msg, JsonFallback& storage) {
+    // 每个线程复用一个解析器
+    thread_local std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
+    Json::Value& root = storage.root;
+    std::string errors;
+    
+    if (!reader->parse(frame.data(), frame.data() + frame.size(), &root, &errors)) {
+        LOG(LOG_WARN) << "Failed to parse JSON: " << errors;
+        return false;
+    }
+    
+    msg = Message{};
+    try {
+        storage.command = root["command"].asString();
+        storage.device_id = root["device_id"].asString();
+        storage.status = root["status"].asString();
+        storage.request_id = root["request_id"].asString();
+        storage.protocol = root["protocol"].asString();
+        msg.temp_threshold = root["temp_threshold"].asDouble();
+        msg.moisture_threshold = root["moisture_threshold"].asDouble();
+        msg.from = root["from"].asDouble();
+        msg.to = root["to"].asDouble();
+        
+        read_device_data(root["data"], msg.data);
+        
+        const Json::Value& samples = root["samples"];
+        // 采样的device_id视图指向sample_device_ids，先预留好避免扩容时字符串被搬移
+        storage.sample_device_ids.reserve(samples.size());
+        for (const Json::Value& item : samples) {
+            BatchSample& sample = msg.samples.emplace_back();
+            storage.sample_device_ids.push_back(item["device_id"].asString());
+            sample.timestamp = timestamp_from_double(item["timestamp"].asDouble());
+            read_device_data(item["data"], sample.data);
+        }
+        
+        const Json::Value& device_ids = root["device_ids"];
+        storage.device_ids.reserve(device_ids.size());
+        for (const Json::Value& item : device_ids) {
+            storage.device_ids.push_back(item.asString());
+        }
+    } catch (const Json::Exception& e) {
+        LOG(LOG_WARN) << "Invalid message: " << e.what();
+        return false;
+    }
+    
+    msg.command = storage.command;
+    msg.device_id = storage.device_id;
+    msg.status = storage.status;
+    msg.request_id = storage.request_id;
+    msg.protocol = storage.protocol;
+    for (size_t i = 0; i < msg.samples.size(); ++i) {
+        msg.samples[i].device_id = storage.sample_device_ids[i];
+    }
+    msg.device_ids.assign(storage.device_ids.begin(), storage.device_ids.end());
+    msg.type = command_type(msg.command);
+    return true;
+}
+
+// 顺序读取二进制消息的字段，越界时返回false
+struct BinaryReader {
+    std::string_view data;
+    size_t pos = 0;
+    
+    bool string(std::string_view& out) {
+        uint16_t len;
+        if (data.size() - pos < sizeof(len)) {
+            return false;
+        }
+        memcpy(&len, data.data() + pos, sizeof(len));
+        pos += sizeof(len);
+        if (data.size() - pos < len) {
+            return false;
+        }
+        out = data.substr(pos, len);
+        pos += len;
+        return true;
+    }
+    
+    bool device_data(DeviceData& out) {
+        if (data.size() - pos < DEVICE_DATA_BYTES) {
+            return false;
+        }
+        unpack_device_data(data.data() + pos, out);
+        pos += DEVICE_DATA_BYTES;
+        return true;
+    }
+    
+    bool finished() const {
+        return pos == data.size();
+    }
+};
+
+// 解码客户端发来的二进制消息（upload、ack、get_data），字符串字段是指向帧的视图
+bool decode_binary_message(std::string_view frame, Message& msg) {
+    msg = Message{};
+    BinaryReader reader{frame, 1};
+    if (!reader.string(msg.device_id)) {
+        return false;
+    }
+    bool ok;
+    switch ((uint8_t)frame[0]) {
+    case BIN_UPLOAD:
+        msg.type = CMD_UPLOAD;
+        msg.command = "upload";
+        ok = reader.device_data(msg.data);
+        break;
+    case BIN_ACK:
+        msg.type = CMD_ACK;
+        msg.command = "ack";
+        ok = reader.string(msg.status) && reader.string(msg.request_id);
+        break;
+    case BIN_GET_DATA:
+        msg.type = CMD_GET_DATA;
+        msg.command = "get_data";
+        ok = true;
+        break;
+    default:
+        return false;
+    }
+    return ok && reader.finished();
+}
+
+// 已下发给设备、等待确认的命令
+struct PendingCommand {
+    std::string request_id;              // 服务器生成，随命令发给设备
+    std::string client_request_id;       // PC请求中的request_id，回复时带回
+    std::weak_ptr<Connection> requester;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+std::mutex pending_mutex;
+std::map<std::string, std::deque<PendingCommand>, std::less<>> pending_commands; // device_id -> 按下发顺序排列
+std::atomic<int64_t> pending_command_count(0);   // 供metrics读取而不加pending_mutex
+
+void add_pending_command(std::string_view device_id, PendingCommand command) {
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    auto it = pending_commands.find(device_id);
+    if (it == pending_commands.end()) {
+        it = pending_commands.emplace(std::string(device_id), std::deque<PendingCommand>()).first;
+    }
+    it->second.push_back(std::move(command));
+    pending_command_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+// 取出设备确认对应的命令：带request_id时精确匹配，旧固件不带则按下发顺序取最早的一条
+bool take_pending_command(std::string_view device_id, std::string_view request_id, PendingCommand& command) {
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    auto it = pending_commands.find(device_id);
+    if (it == pending_commands.end()) {
+        return false;
+    }
+    auto& queue = it->second;
+    auto match = request_id.empty() ? queue.begin() : std::find_if(queue.begin(), queue.end(), [&](const PendingCommand& pending) {
+        return pending.request_id == request_id;
+    });
+    if (match == queue.end()) {
+        return false;
+    }
+    command = std::move(*match);
+    queue.erase(match);
+    pending_command_count.fetch_sub(1, std::memory_order_relaxed);
+    if (queue.empty()) {
+        pending_commands.erase(it);
+    }
+    return true;
+}
+
+// 超时未确认的命令回复PC timeout
+void expire_pending_commands(std::chrono::steady_clock::time_point now) {
+    std::vector<std::pair<std::string, PendingCommand>> expired;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        for (auto it = pending_commands.begin(); it != pending_commands.end();) {
+            auto& queue = it->second;
+            for (auto cmd = queue.begin(); cmd != queue.end();) {
+                if (cmd->deadline <= now) {
+                    expired.emplace_back(it->first, std::move(*cmd));
+                    cmd = queue.erase(cmd);
+                } else {
+                    ++cmd;
+                }
+            }
+            it = queue.empty() ? pending_commands.erase(it) : std::next(it);
+        }
+        pending_command_count.fetch_sub(expired.size(), std::memory_order_relaxed);
+    }
+    for (const auto& entry : expired) {
+        LOG(LOG_WARN) << "Command " << entry.second.request_id << " to device " << entry.first << " timed out";
+        if (auto pc = entry.second.requester.lock()) {
+            send_to_client(pc, encode_ack(*pc, entry.first, "timeout", entry.second.client_request_id));
+        }
+    }
+}
+
+void command_timeout_loop() {
+    while (server_running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        expire_pending_commands(std::chrono::steady_clock::now());
+    }
+}
+
+// 登记连接的身份，STM32连接同时登记到device_connections。
+// device_id和type只由连接所属I/O线程修改，身份未变时不加锁直接返回
+void register_client(const std::shared_ptr<Connection>& conn, std::string_view device_id, int type) {
+    if (conn->type == type && conn->device_id == device_id) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    if (conn->type == CLIENT_STM32) {
+        auto it = device_connections.find(conn->device_id);
+        if (it != device_connections.end() && it->second == conn) {
+            device_connections.erase(it);
+        }
+    }
+    client_counts[conn->type].fetch_sub(1, std::memory_order_relaxed);
+    client_counts[type].fetch_add(1, std::memory_order_relaxed);
+    conn->device_id = device_id;
+    conn->type = type;
+    connected_clients[conn->fd] = conn;
+    if (type == CLIENT_STM32) {
+        // 设备换了新连接重新上报时覆盖旧连接
+        auto it = device_connections.find(device_id);
+        if (it != device_connections.end()) {
+            it->second = conn;
+        } else {
+            device_connections.emplace(std::string(device_id), conn);
+        }
+    }
+}
+
+// 集中器批量上报的下挂设备也登记到该连接，设置这些设备的阈值时经集中器转发
+void register_routed_devices(const std::shared_ptr<Connection>& conn, const std::vector<std::string_view>& devices) {
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    for (std::string_view device_id : devices) {
+        if (device_id == conn->device_id) {
+            continue;
+        }
+        auto it = device_connections.find(device_id);
+        if (it == device_connections.end()) {
+            device_connections.emplace(std::string(device_id), conn);
+        } else if (it->second != conn) {
+            it->second = conn;
+        }
+        if (conn->routed_devices.find(device_id) == conn->routed_devices.end()) {
+            conn->routed_devices.emplace(device_id);
+        }
+    }
+}
+
+// 一条消息的分阶段计时，析构时记入当前线程的统计。
+// lap(phase)把上次lap以来的耗时记到phase上，同一阶段可以多次lap累加；没有lap过的阶段不记录
+class CommandTrace {
+public:
+    CommandType type = CMD_UNKNOWN;
+    
+    CommandTrace() : start(clock_ns()), last(start) {}
+    
+    ~CommandTrace() {
+        LatencyHistogram* latency = thread_stats.local().latency[type];
+        for (int phase = 0; phase < PHASE_TOTAL; ++phase) {
+            if (laps & (1u << phase)) {
+                latency[phase].record(elapsed[phase]);
+            }
+        }
+        latency[PHASE_TOTAL].record(clock_ns() - start);
+    }
+    
+    void lap(StatPhase phase) {
+        uint64_t now = clock_ns();
+        elapsed[phase] += now - last;
+        last = now;
+        laps |= 1u << phase;
+    }
+    
+private:
+    static uint64_t clock_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    uint64_t start;
+    uint64_t last;
+    uint64_t elapsed[PHASE_COUNT] = {};
+    unsigned laps = 0;
+};
+
+// stats控制台命令：每种收到过的命令一行次数，各阶段一行分位数（微秒）
+void print_command_stats(std::ostream& out) {
+    auto stats = thread_stats.aggregate();
+    out << "Command stats (latency in us):" << std::endl;
+    char line[160];
+    for (int type = 0; type <= CMD_HELLO; ++type) {
+        const LatencyHistogram* latency = stats->latency[type];
+        if (latency[PHASE_TOTAL].count() == 0) {
+            continue;
+        }
+        out << command_name((CommandType)type) << ": " << latency[PHASE_TOTAL].count() << std::endl;
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            const LatencyHistogram& h = latency[phase];
+            if (h.count() == 0) {
+                continue;
+            }
+            snprintf(line, sizeof(line), "  %-10s count=%-10llu mean=%-9.2f p50=%-9.2f p99=%-9.2f p999=%-9.2f max=%.2f",
+                     PHASE_NAMES[phase], (unsigned long long)h.count(), h.mean() / 1e3, h.percentile(0.5) / 1e3,
+                     h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.maximum() / 1e3);
+            out << line << std::endl;
+        }
+    }
+}
+
+// stats_json控制台命令：同样的统计输出为一行JSON（纳秒），便于脚本采集
+std::string command_stats_json() {
+    auto stats = thread_stats.aggregate();
+    Json::Value root;
+    Json::Value& commands = root["commands"];
+    commands = Json::objectValue;
+    for (int type = 0; type <= CMD_HELLO; ++type) {
+        const LatencyHistogram* latency = stats->latency[type];
+        if (latency[PHASE_TOTAL].count() == 0) {
+            continue;
+        }
+        Json::Value& command = commands[command_name((CommandType)type)];
+        command["count"] = (Json::UInt64)latency[PHASE_TOTAL].count();
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            const LatencyHistogram& h = latency[phase];
+            if (h.count() == 0) {
+                continue;
+            }
+            Json::Value& entry = command[PHASE_NAMES[phase]];
+            entry["count"] = (Json::UInt64)h.count();
+            entry["mean_ns"] = (Json::UInt64)h.mean();
+            entry["p50_ns"] = (Json::UInt64)h.percentile(0.5);
+            entry["p99_ns"] = (Json::UInt64)h.percentile(0.99);
+            entry["p999_ns"] = (Json::UInt64)h.percentile(0.999);
+            entry["max_ns"] = (Json::UInt64)h.maximum();
+        }
+    }
+    return Json::writeString(json_writer(), root);
+}
+
+void handle_command(const std::shared_ptr<Connection>& conn, Message& msg, CommandTrace& trace);
+
+void handle_message(const std::shared_ptr<Connection>& conn, std::string_view frame) {
+    CommandTrace trace;
+    log_payload("Received message: ", frame);
+    
+    Message msg;
+    JsonFallback fallback;
+    if (conn->binary && is_binary_frame(frame)) {
+        if (!decode_binary_message(frame, msg)) {
+            trace.lap(PHASE_PARSE);
+            LOG(LOG_WARN) << "Invalid binary message from connection " << conn->id;
+            return;
+        }
+    } else if (!decode_message(frame, msg) && !decode_message_jsoncpp(frame, msg, fallback)) {
+        trace.lap(PHASE_PARSE);
+        return;
+    }
+    trace.lap(PHASE_PARSE);
+    handle_command(conn, msg, trace);
+}
+
+// 执行已解码的消息，JSON、二进制和MQTT连接共用
+void handle_command(const std::shared_ptr<Connection>& conn, Message& msg, CommandTrace& trace) {
+    trace.type = msg.type;
+    
+    std::string_view device_id = msg.device_id;
+    std::string response;
+    
+    if (msg.type == CMD_UPLOAD) {
+        // STM32上传数据
+        device_store.upload(device_id, msg.data);
+        
+        // 标记为STM32客户端
+        register_client(conn, device_id, CLIENT_STM32);
+        trace.lap(PHASE_STORE);
+        
+        response = encode_ack(*conn, device_id, "success");
+        trace.lap(PHASE_SERIALIZE);
+        LOG(LOG_INFO) << "Updated data for device: " << device_id;
+        
+        // 推送给订阅者
+        broadcast_data_response(device_id);
+    } else if (msg.type == CMD_UPLOAD_BATCH) {
+        // STM32补传缓存的采样或集中器汇总上传：整帧一次解析，每个分片加一次锁，只回复一个ack
+        if (device_id.empty()) {
+            response = encode_ack(*conn, device_id, "invalid_device_id");
+            trace.lap(PHASE_SERIALIZE);
+        } else {
+            for (BatchSample& sample : msg.samples) {
+                if (sample.device_id.empty()) {
+                    sample.device_id = device_id;
+                }
+            }
+            std::vector<std::string_view> updated;
+            device_store.upload_batch(msg.samples, now_ms(), updated);
+            register_client(conn, device_id, CLIENT_STM32);
+            register_routed_devices(conn, updated);
+            trace.lap(PHASE_STORE);
+            
+            response = encode_ack(*conn, device_id, "success");
+            trace.lap(PHASE_SERIALIZE);
+            LOG(LOG_INFO) << "Updated " << msg.samples.size() << " samples for " << updated.size() << " devices from: " << device_id;
+            for (std::string_view updated_id : updated) {
+                broadcast_data_response(updated_id);
+            }
+        }
+    } else if (msg.type == CMD_GET_DATA) {
+        // PC请求数据
+        register_client(conn, device_id, CLIENT_PC);
+        // 查询过的设备自动订阅，之后的上报会推送过来
+        if (!device_id.empty()) {
+            subscriptions.subscribe(conn, device_id, false);
+        }
+        LOG(LOG_INFO) << "Responding to data request for device: " << device_id;
+        std::shared_ptr<const RenderedResponse> cached = device_store.data_response(device_id);
+        trace.lap(PHASE_STORE);
+        if (cached) {
+            io_engine->send(conn, cached->frame_for(*conn));
+            trace.lap(PHASE_SEND);
+            log_payload("Sent response: ", cached->body);
+            return;
+        }
+        response = encode_ack(*conn, device_id, "device_not_found");
+        trace.lap(PHASE_SERIALIZE);
+    } else if (msg.type == CMD_GET_DATA_MULTI) {
+        // PC一次查询多个设备：device_ids列表，或device_id以'*'结尾的前缀。查询的设备同样自动订阅
+        register_client(conn, conn->device_id, CLIENT_PC);
+        bool prefix = msg.device_ids.empty() && !device_id.empty() && device_id.back() == '*';
+        if (prefix) {
+            msg.device_ids.push_back(device_id.substr(0, device_id.size() - 1));
+        }
+        if (msg.device_ids.empty()) {
+            response = encode_ack(*conn, device_id, "invalid_device_id");
+            trace.lap(PHASE_SERIALIZE);
+        } else {
+            for (std::string_view key : msg.device_ids) {
+                if (!key.empty() || prefix) {
+                    subscriptions.subscribe(conn, key, prefix);
+                }
+            }
+            std::vector<std::string_view> missing;
+            bool truncated;
+            auto responses = device_store.data_responses(msg.device_ids, prefix, missing, truncated);
+            trace.lap(PHASE_STORE);
+            response = create_data_multi_response(responses, missing, truncated);
+            trace.lap(PHASE_SERIALIZE);
+            LOG(LOG_INFO) << "Responding to data request for " << responses.size() << " devices";
+        }
+    } else if (msg.type == CMD_SET_THRESHOLD) {
+        // PC设置阈值
+        double temp_threshold = msg.temp_threshold;
+        double moisture_threshold = msg.moisture_threshold;
+        device_store.set_thresholds(device_id, temp_threshold, moisture_threshold);
+        
+        // 查找对应的STM32客户端并发送更新
+        std::shared_ptr<Connection> stm32;
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            auto it = device_connections.find(device_id);
+            if (it != device_connections.end()) {
+                stm32 = it->second;
+            }
+        }
+        trace.lap(PHASE_STORE);
+        
+        if (stm32) {
+            // 先登记再下发，设备的确认不会早于登记到达
+            PendingCommand command;
+            command.request_id = std::to_string(next_request_id++);
+            command.client_request_id = std::string(msg.request_id);
+            command.requester = conn;
+            command.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(COMMAND_TIMEOUT_MS);
+            std::string update_msg = encode_update_threshold(*stm32, device_id, temp_threshold, moisture_threshold, command.request_id);
+            trace.lap(PHASE_SERIALIZE);
+            add_pending_command(device_id, std::move(command));
+            trace.lap(PHASE_STORE);
+            send_to_client(stm32, update_msg);
+            trace.lap(PHASE_SEND);
+            LOG(LOG_INFO) << "Forwarding threshold update to STM32 for device: " << device_id;
+        } else {
+            response = encode_ack(*conn, device_id, "device_not_connected", msg.request_id);
+            trace.lap(PHASE_SERIALIZE);
+            send_to_client(conn, response);
+            trace.lap(PHASE_SEND);
+            LOG(LOG_WARN) << "STM32 device not connected: " << device_id;
+        }
+        
+        // STM32的确认由它自己的连接收到后再回复PC，这里不阻塞等待
+        return;
+    } else if (msg.type == CMD_ACK) {
+        // STM32确认阈值更新，按request_id找到发起设置的PC并转发
+        std::string_view ack_device = device_id.empty() ? std::string_view(conn->device_id) : device_id;
+        PendingCommand command;
+        bool matched = take_pending_command(ack_device, msg.request_id, command);
+        trace.lap(PHASE_STORE);
+        if (!matched) {
+            LOG(LOG_WARN) << "Unmatched ACK from device: " << ack_device;
+            return;
+        }
+        
+        log_payload("Received STM32 ACK from device: ", ack_device);
+        if (auto pc = command.requester.lock()) {
+            std::string forwarded = encode_ack(*pc, ack_device, msg.status, command.client_request_id);
+            trace.lap(PHASE_SERIALIZE);
+            send_to_client(pc, forwarded);
+            trace.lap(PHASE_SEND);
+        }
+        return;
+    } else if (msg.type == CMD_SUBSCRIBE || msg.type == CMD_UNSUBSCRIBE) {
+        // PC订阅或退订设备更新，device_id以'*'结尾表示前缀订阅
+        register_client(conn, conn->device_id, CLIENT_PC);
+        bool prefix = !device_id.empty() && device_id.back() == '*';
+        std::string_view key = prefix ? device_id.substr(0, device_id.size() - 1) : device_id;
+        const char* status;
+        if (key.empty() && !prefix) {
+            status = "invalid_device_id";
+        } else if (msg.type == CMD_SUBSCRIBE) {
+            subscriptions.subscribe(conn, key, prefix);
+            status = "subscribed";
+        } else {
+            status = subscriptions.unsubscribe(*conn, key, prefix) ? "unsubscribed" : "not_subscribed";
+        }
+        trace.lap(PHASE_STORE);
+        response = encode_ack(*conn, device_id, status);
+        trace.lap(PHASE_SERIALIZE);
+    } else if (msg.type == CMD_GET_HISTORY) {
+        // PC查询历史，from/to缺省时取全部
+        register_client(conn, device_id, CLIENT_PC);
+        int64_t from = timestamp_from_double(msg.from);
+        int64_t to = msg.to > 0 ? timestamp_from_double(msg.to) : INT64_MAX;
+        std::vector<HistorySample> samples;
+        bool found = device_store.history(device_id, from, to, samples);
+        trace.lap(PHASE_STORE);
+        if (found) {
+            response = create_history_response(device_id, samples);
+        } else {
+            response = encode_ack(*conn, device_id, "device_not_found");
+        }
+        trace.lap(PHASE_SERIALIZE);
+    } else if (msg.type == CMD_HELLO) {
+        // 协商编码。二进制消息需要长度前缀分帧；hello本身的回复仍是JSON
+        if (msg.protocol == "binary") {
+            if (conn->framer.mode == FRAME_LENGTH_PREFIXED) {
+                response = create_ack(device_id, "binary");
+                conn->binary = true;
+            } else {
+                response = create_ack(device_id, "unsupported_framing");
+            }
+        } else if (msg.protocol == "json") {
+            response = create_ack(device_id, "json");
+            conn->binary = false;
+        } else {
+            response = create_ack(device_id, "unsupported_protocol");
+        }
+        trace.lap(PHASE_SERIALIZE);
+        send_to_client(conn, response);
+        trace.lap(PHASE_SEND);
+        return;
+    } else {
+        response = encode_ack(*conn, device_id, "unknown_command");
+        trace.lap(PHASE_SERIALIZE);
+        LOG(LOG_WARN) << "Unknown command received: " << msg.command;
+    }
+    
+    send_to_client(conn, response);
+    trace.lap(PHASE_SEND);
+    if (!response.empty()) {
+        log_payload("Sent response: ", response);
+    }
+}
+
+
+// 主题中的device_id不能为空，也不能含控制字符、引号和反斜杠。消息经jsoncpp转义，这里不是为了防注入，
+// 而是不接受在日志、控制台输出中显示异常且TCP设备通常不会使用的ID
+bool valid_topic_device_id(std::string_view device_id) {
+    return !device_id.empty() && std::none_of(device_id.begin(), device_id.end(), [](char c) {
+        return c == '"' || c == '\\' || (unsigned char)c < 0x20;
+    });
+}
+
+// 解码MQTT PUBLISH的内容：upload为data对象，ack只取status和request_id。
+// 内容必须是单个JSON对象；其中的command、device_id等字段一律忽略，命令和设备只由主题决定
+bool decode_mqtt_payload(std::string_view payload, Message& msg, JsonFallback& storage) {
+    thread_local StructuralIndex index;
+    index.count = 0;
+    if (structural_scanner.scan(payload.data(), payload.size(), index)) {
+        StructuralWalker walker(payload, index);
+        bool ok;
+        if (msg.type == CMD_UPLOAD) {
+            ok = decode_device_data(walker, msg.data);
+        } else {
+            ok = parse_object(walker, [&](std::string_view key) {
+                if (key == "status") {
+                    return walker.string(msg.status);
+                } else if (key == "request_id") {
+                    return walker.string(msg.request_id);
+                }
+                return walker.skip_value();
+            });
+        }
+        if (ok && walker.finished()) {
+            return true;
+        }
+    }
+    
+    // 含转义字符等快速路径不处理的内容交给jsoncpp
+    thread_local std::unique_ptr<Json::CharReader> reader([] {
+        Json::CharReaderBuilder builder;
+        builder["failIfExtra"] = true;
+        return builder.newCharReader();
+    }());
+    Json::Value& root = storage.root;
+    std::string errors;
+    if (!reader->parse(payload.data(), payload.data() + payload.size(), &root, &errors) || !root.isObject()) {
+        return false;
+    }
+    msg.data = DeviceData{};
+    try {
+        if (msg.type == CMD_UPLOAD) {
+            read_device_data(root, msg.data);
+        } else {
+            storage.status = root["status"].asString();
+            storage.request_id = root["request_id"].asString();
+            msg.status = storage.status;
+            msg.request_id = storage.request_id;
+        }
+    } catch (const Json::Exception& e) {
+        return false;
+    }
+    return true;
+}
+
+// MQTT PUBLISH直接解码成Message执行，命令和设备ID取自主题：
+// devices/<id>/data的内容为上报的data对象，devices/<id>/ack的内容为确认的status、request_id。
+// QoS 1处理完后回复PUBACK，QoS 2不支持
+bool handle_mqtt_publish(const std::shared_ptr<Connection>& conn, uint8_t flags, std::string_view body) {
+    uint8_t qos = (flags >> 1) & 3;
+    size_t pos = 0;
+    std::string_view topic;
+    if (!read_mqtt_string(body, pos, topic)) {
+        return false;
+    }
+    if (qos > 1) {
+        LOG(LOG_WARN) << "MQTT QoS " << (int)qos << " not supported, closing connection";
+        return false;
+    }
+    std::string_view packet_id;
+    if (qos == 1) {
+        if (body.size() - pos < 2) {
+            return false;
+        }
+        packet_id = body.substr(pos, 2);
+        pos += 2;
+    }
+    std::string_view payload = body.substr(pos);
+    
+    std::string_view device_id;
+    std::string_view suffix;
+    if (topic.substr(0, 8) == "devices/") {
+        device_id = topic.substr(8, topic.find('/', 8) - 8);
+        suffix = topic.substr(std::min(topic.size(), 9 + device_id.size()));
+    }
+    if (valid_topic_device_id(device_id) && (suffix == "data" || suffix == "ack")) {
+        CommandTrace trace;
+        log_payload("Received MQTT publish: ", payload);
+        Message msg;
+        JsonFallback fallback;
+        msg.type = suffix == "data" ? CMD_UPLOAD : CMD_ACK;
+        msg.command = command_name(msg.type);
+        msg.device_id = device_id;
+        bool ok = decode_mqtt_payload(payload, msg, fallback);
+        trace.lap(PHASE_PARSE);
+        if (ok) {
+            handle_command(conn, msg, trace);
+        } else {
+            LOG(LOG_WARN) << "Invalid MQTT payload on topic: " << topic;
+        }
+    } else {
+        LOG(LOG_WARN) << "Ignoring MQTT publish to topic: " << topic;
+    }
+    
+    if (qos == 1) {
+        io_engine->send(conn, mqtt_packet(MQTT_PUBACK, 0, packet_id));
+    }
+    return true;
+}
+
+// 把主题过滤器映射到订阅表，返回false表示不支持该过滤器。
+// devices/<id>/data和devices/<id>/#订阅单个设备；devices/+/data、devices/#和#订阅全部设备（空前缀）；
+// devices/<id>/threshold和devices/+/threshold是设备接收阈值的主题，下发按连接路由，不进订阅表（data_topic为false）
+bool parse_mqtt_filter(std::string_view filter, bool& data_topic, std::string_view& key, bool& prefix) {
+    data_topic = true;
+    key = {};
+    prefix = true;
+    if (filter == "#" || filter == "devices/#") {
+        return true;
+    }
+    if (filter.substr(0, 8) != "devices/") {
+        return false;
+    }
+    std::string_view device_id = filter.substr(8, filter.find('/', 8) - 8);
+    std::string_view suffix = filter.substr(std::min(filter.size(), 9 + device_id.size()));
+    if (suffix == "threshold" && (device_id == "+" || !device_id.empty())) {
+        data_topic = false;
+        return device_id.find_first_of("+#") == std::string_view::npos || device_id == "+";
+    }
+    if (device_id == "+") {
+        return suffix == "data";
+    }
+    if (device_id.empty() || device_id.find_first_of("+#") != std::string_view::npos || (suffix != "data" && suffix != "#")) {
+        return false;
+    }
+    key = device_id;
+    prefix = false;
+    return true;
+}
+
+// SUBSCRIBE/UNSUBSCRIBE：数据主题进订阅表，之后设备的每次上报以QoS 0的PUBLISH推送，内容为data_response
+bool handle_mqtt_subscribe(const std::shared_ptr<Connection>& conn, bool subscribe, std::string_view body) {
+    CommandTrace trace;
+    trace.type = subscribe ? CMD_SUBSCRIBE : CMD_UNSUBSCRIBE;
+    if (body.size() < 2) {
+        return false;
+    }
+    std::string response(body.substr(0, 2)); // packet id
+    size_t pos = 2;
+    while (pos < body.size()) {
+        std::string_view filter;
+        if (!read_mqtt_string(body, pos, filter)) {
+            return false;
+        }
+        if (subscribe && pos++ >= body.size()) {
+            return false; // 缺少请求的QoS
+        }
+        bool data_topic;
+        std::string_view key;
+        bool prefix;
+        bool supported = parse_mqtt_filter(filter, data_topic, key, prefix);
+        if (supported && data_topic) {
+            if (subscribe) {
+                // 设备订阅数据主题时仍按设备登记，只有身份未定的连接登记为监控端
+                if (conn->type == CLIENT_UNKNOWN) {
+                    register_client(conn, conn->device_id, CLIENT_PC);
+                }
+                subscriptions.subscribe(conn, key, prefix);
+            } else {
+                subscriptions.unsubscribe(*conn, key, prefix);
+            }
+        }
+        if (subscribe) {
+            // 返回码：0x00为授予QoS 0，0x80为失败
+            response.push_back(supported ? 0x00 : (char)0x80);
+            if (!supported) {
+                LOG(LOG_WARN) << "Unsupported MQTT topic filter: " << filter;
+            }
+        }
+    }
+    if (pos == 2) {
+        return false; // 至少一个主题
+    }
+    trace.lap(PHASE_STORE);
+    io_engine->send(conn, mqtt_packet(subscribe ? MQTT_SUBACK : MQTT_UNSUBACK, 0, response));
+    trace.lap(PHASE_SEND);
+    return true;
+}
+
+bool handle_mqtt_packet(const std::shared_ptr<Connection>& conn, uint8_t type, uint8_t flags, std::string_view body) {
+    switch (type) {
+    case MQTT_PUBLISH:
+        return handle_mqtt_publish(conn, flags, body);
+    case MQTT_SUBSCRIBE:
+    case MQTT_UNSUBSCRIBE:
+        // 这两种报文的固定头标志必须为0010
+        return flags == 2 && handle_mqtt_subscribe(conn, type == MQTT_SUBSCRIBE, body);
+    case MQTT_PUBACK:
+        return true; // 服务器只发QoS 0，不应收到，忽略
+    default:
+        LOG(LOG_WARN) << "Unexpected MQTT packet type " << (int)type;
+        return false;
+    }
+}
+
+// 在连接缓冲区上切帧并处理，返回false表示协议错误需要断开
+// 切出data中的完整帧并逐帧处理，返回已消费的字节数；首字节为'G'的连接按WebSocket处理
+ssize_t extract_frames(const std::shared_ptr<Connection>& conn, const char* data, size_t len) {
+    auto on_frame = [&](std::string_view frame) {
+        handle_message(conn, frame);
+    };
+    if (conn->framer.mode == FRAME_UNKNOWN && len > 0 && data[0] == 'G') {
+        conn->framer.mode = FRAME_WEBSOCKET;
+        LOG(LOG_INFO) << "WebSocket upgrade request on connection " << conn->id;
+    }
+    // 握手、控制报文的回复已按各自格式封装，不再经frame_message
+    auto reply = [&](const std::string& raw) {
+        io_engine->send(conn, raw);
+    };
+    if (conn->framer.mode == FRAME_WEBSOCKET) {
+        return conn->websocket.extract(data, len, on_frame, reply);
+    }
+    if (conn->framer.mode == FRAME_MQTT) {
+        return conn->mqtt.extract(data, len, [&](uint8_t type, uint8_t flags, std::string_view body) {
+            return handle_mqtt_packet(conn, type, flags, body);
+        }, reply);
+    }
+    return conn->framer.extract(data, len, on_frame);
+}
+
+bool process_recv_buffer(const std::shared_ptr<Connection>& conn) {
+    ssize_t used = extract_frames(conn, conn->inbuf.data(), conn->inbuf.size());
+    if (used < 0) {
+        return false;
+    }
+    conn->inbuf.consume(used);
+    return true;
+}
+
+// 处理I/O线程读到的一段数据。连接上没有半帧时直接在data上切帧，
+// 只把末尾不完整的部分拷进连接缓冲区
+bool process_received(const std::shared_ptr<Connection>& conn, const char* data, size_t len) {
+    if (!conn->inbuf.empty()) {
+        conn->inbuf.append(data, len);
+        return process_recv_buffer(conn);
+    }
+    
+    ssize_t used = extract_frames(conn, data, len);
+    if (used < 0) {
+        return false;
+    }
+    if ((size_t)used < len) {
+        conn->inbuf.append(data + used, len - used);
+    }
+    return true;
+}
+
+// 把连接从客户端表中移除，并在send_mutex内关闭fd，避免其他线程向被复用的fd写数据
+void release_connection(const std::shared_ptr<Connection>& conn) {
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        auto it = connected_clients.find(conn->fd);
+        if (it != connected_clients.end() && it->second == conn) {
+            connected_clients.erase(it);
+        }
+        // 设备已在新连接上重新上报时不能删掉新的登记
+        auto device = device_connections.find(conn->device_id);
+        if (device != device_connections.end() && device->second == conn) {
+            device_connections.erase(device);
+        }
+        for (const std::string& routed : conn->routed_devices) {
+            auto entry = device_connections.find(routed);
+            if (entry != device_connections.end() && entry->second == conn) {
+                device_connections.erase(entry);
+            }
+        }
+    }
+    subscriptions.remove(*conn);
+    std::lock_guard<std::mutex> lock(conn->send_mutex);
+    conn->closed = true;
+    close(conn->fd);
+}
+
+// 第index个I/O线程绑定的CPU（取进程允许运行的第index个核），失败返回-1
+int worker_cpu(unsigned index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return -1;
+    }
+    index %= CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+void pin_current_thread(int cpu) {
+    if (cpu < 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+// 每个I/O线程各自持有一个监听socket，由内核通过SO_REUSEPORT把新连接分散到各线程
+int create_listener(int port, int cpu, bool nonblocking) {
+    int server_fd;
+    struct sockaddr_in address;
+    int opt = 1;
+    
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0)) < 0) {
+        LOG(LOG_ERROR) << "Socket creation error";
+        return -1;
+    }
+    
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))
+        || setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        LOG(LOG_ERROR) << "Setsockopt error";
+        close(server_fd);
+        return -1;
+    }
+    
+    // 关闭Nagle，accept得到的连接继承该选项。否则连接上有未确认的推送时，小的回复要等对端ACK才能发出
+    setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    
+    // 内核挑选监听socket时优先选择与收包CPU一致的那个
+    if (cpu >= 0) {
+        setsockopt(server_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+    
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        LOG(LOG_ERROR) << "Bind failed";
+        close(server_fd);
+        return -1;
+    }
+    
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        LOG(LOG_ERROR) << "Listen failed";
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+// 耗时直方图输出给Prometheus的桶边界（秒），按LatencyHistogram的桶粒度计数
+const std::pair<uint64_t, const char*> LATENCY_BUCKETS[] = {
+    {1000, "1e-06"}, {2500, "2.5e-06"}, {5000, "5e-06"}, {10000, "1e-05"}, {25000, "2.5e-05"},
+    {50000, "5e-05"}, {100000, "0.0001"}, {250000, "0.00025"}, {500000, "0.0005"}, {1000000, "0.001"},
+    {2500000, "0.0025"}, {5000000, "0.005"}, {10000000, "0.01"}, {25000000, "0.025"}, {50000000, "0.05"},
+    {100000000, "0.1"}, {250000000, "0.25"}, {500000000, "0.5"}, {1000000000, "1"}
+};
+const std::pair<uint64_t, const char*> FANOUT_BUCKETS[] = {
+    {0, "0"}, {1, "1"}, {2, "2"}, {5, "5"}, {10, "10"}, {20, "20"}, {50, "50"}, {100, "100"},
+    {200, "200"}, {500, "500"}, {1000, "1000"}
+};
+
+// labels为空或形如`command="upload",`，末尾的逗号用于接上le
+template <size_t N>
+void append_histogram(std::string& out, const char* name, const std::string& labels, const LatencyHistogram& h,
+                      const std::pair<uint64_t, const char*> (&buckets)[N], double scale) {
+    for (const auto& bucket : buckets) {
+        out += std::string(name) + "_bucket{" + labels + "le=\"" + bucket.second + "\"} " + std::to_string(h.count_at_most(bucket.first)) + "\n";
+    }
+    out += std::string(name) + "_bucket{" + labels + "le=\"+Inf\"} " + std::to_string(h.count()) + "\n";
+    std::string plain = labels.empty() ? "" : "{" + labels.substr(0, labels.size() - 1) + "}";
+    char sum[32];
+    snprintf(sum, sizeof(sum), "%.9g", h.total_sum() * scale);
+    out += std::string(name) + "_sum" + plain + " " + sum + "\n";
+    out += std::string(name) + "_count" + plain + " " + std::to_string(h.count()) + "\n";
+}
+
+// Prometheus文本格式的指标。只读原子计数和各线程的统计，不加clients_mutex、设备表和待确认命令的锁
+std::string render_metrics() {
+    auto stats = thread_stats.aggregate();
+    std::string out;
+    out += "# HELP iot_gateway_connections Open client connections by client type.\n";
+    out += "# TYPE iot_gateway_connections gauge\n";
+    const char* const client_types[] = {"unknown", "stm32", "pc"};
+    for (int type = CLIENT_UNKNOWN; type <= CLIENT_PC; ++type) {
+        out += std::string("iot_gateway_connections{type=\"") + client_types[type] + "\"} "
+            + std::to_string(client_counts[type].load(std::memory_order_relaxed)) + "\n";
+    }
+    
+    out += "# HELP iot_gateway_messages_total Messages handled by command; unknown includes undecodable frames.\n";
+    out += "# TYPE iot_gateway_messages_total counter\n";
+    for (int type = 0; type <= CMD_HELLO; ++type) {
+        out += std::string("iot_gateway_messages_total{command=\"") + command_name((CommandType)type) + "\"} "
+            + std::to_string(stats->latency[type][PHASE_TOTAL].count()) + "\n";
+    }
+    
+    out += "# HELP iot_gateway_outbound_queued_bytes Bytes queued for sending across all connections.\n";
+    out += "# TYPE iot_gateway_outbound_queued_bytes gauge\n";
+    out += "iot_gateway_outbound_queued_bytes " + std::to_string(stats->outbound_bytes.load(std::memory_order_relaxed)) + "\n";
+    out += "# HELP iot_gateway_pending_commands Threshold updates waiting for a device ack.\n";
+    out += "# TYPE iot_gateway_pending_commands gauge\n";
+    out += "iot_gateway_pending_commands " + std::to_string(pending_command_count.load(std::memory_order_relaxed)) + "\n";
+    out += "# HELP iot_gateway_wal_queued_bytes WAL bytes waiting for the next group commit.\n";
+    out += "# TYPE iot_gateway_wal_queued_bytes gauge\n";
+    out += "iot_gateway_wal_queued_bytes " + std::to_string(wal.queued_bytes()) + "\n";
+    
+    out += "# HELP iot_gateway_broadcast_fanout Subscribers reached by each device update.\n";
+    out += "# TYPE iot_gateway_broadcast_fanout histogram\n";
+    append_histogram(out, "iot_gateway_broadcast_fanout", "", stats->fanout, FANOUT_BUCKETS, 1);
+    
+    out += "# HELP iot_gateway_command_duration_seconds Time spent in each phase of handling a message.\n";
+    out += "# TYPE iot_gateway_command_duration_seconds histogram\n";
+    for (int type = 0; type <= CMD_HELLO; ++type) {
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            const LatencyHistogram& h = stats->latency[type][phase];
+            if (h.count() == 0) {
+                continue;
+            }
+            std::string labels = std::string("command=\"") + command_name((CommandType)type) + "\",phase=\"" + PHASE_NAMES[phase] + "\",";
+            append_histogram(out, "iot_gateway_command_duration_seconds", labels, h, LATENCY_BUCKETS, 1e-9);
+        }
+    }
+    return out;
+}
+
+// 读一个HTTP请求头并回复，只支持GET /metrics
+void serve_metrics_request(int fd) {
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0 || request.size() + n > 8192) {
+            return;
+        }
+        request.append(buffer, n);
+    }
+    
+    std::string status = "200 OK";
+    std::string body;
+    size_t path_end = request.find_first_of(" ?", 4);
+    if (request.compare(0, 4, "GET ") != 0) {
+        status = "405 Method Not Allowed";
+    } else if (request.compare(4, path_end - 4, "/metrics") != 0) {
+        status = "404 Not Found";
+    } else {
+        body = render_metrics();
+    }
+    std::string response = "HTTP/1.1 " + status + "\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n\r\n" + body;
+    write_all(fd, response.data(), response.size());
+}
+
+// 指标端口的独立线程，逐个处理抓取请求；每100ms检查一次是否退出
+void metrics_loop(int listen_fd) {
+    while (server_running) {
+        pollfd ready{listen_fd, POLLIN, 0};
+        if (poll(&ready, 1, 100) <= 0) {
+            continue;
+        }
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        // 不完整的请求不会卡住线程
+        timeval timeout{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_metrics_request(fd);
+        close(fd);
+    }
+    close(listen_fd);
+}
+
+// epoll边沿触发，每个I/O线程独占一个监听socket和它接受的全部连接
+class EpollEngine : public IoEngine {
+    struct Worker {
+        int epoll_fd = -1;
+        int listen_fd = -1;
+        int mqtt_listen_fd = -1;
+        int cpu = -1;
+        int wake_fd = -1;
+        std::unordered_map<int, std::shared_ptr<Connection>> connections;
+        std::mutex flush_mutex;
+        std::vector<std::shared_ptr<Connection>> flush_list;
+        std::thread thread;
+    };
+    
+    inline static thread_local Worker* current_worker = nullptr;
+    
+public:
+    const char* name() const override { return "epoll"; }
+    
+    bool start(int port, int mqtt_port, unsigned thread_count) override {
+        for (unsigned i = 0; i < thread_count; ++i) {
+            auto worker = std::make_unique<Worker>();
+            worker->cpu = worker_cpu(i);
+            worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            worker->listen_fd = create_listener(port, worker->cpu, true);
+            if (mqtt_port > 0) {
+                worker->mqtt_listen_fd = create_listener(mqtt_port, worker->cpu, true);
+            }
+            worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            bool ok = worker->epoll_fd >= 0 && worker->listen_fd >= 0 && worker->wake_fd >= 0
+                && (mqtt_port <= 0 || worker->mqtt_listen_fd >= 0);
+            if (ok) {
+                // data.ptr为空表示监听socket，指向mqtt_listen_fd表示MQTT监听socket，指向Worker表示唤醒用的eventfd
+                epoll_event ev{};
+                ev.events = EPOLLIN | EPOLLET;
+                ev.data.ptr = nullptr;
+                ok = epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd, &ev) == 0;
+                if (mqtt_port > 0) {
+                    ev.data.ptr = &worker->mqtt_listen_fd;
+                    ok = ok && epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->mqtt_listen_fd, &ev) == 0;
+                }
+                ev.data.ptr = worker.get();
+                ok = ok && epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev) == 0;
+            }
+            workers.push_back(std::move(worker));
+            if (!ok) {
+                LOG(LOG_ERROR) << "epoll setup failed";
+                close_workers();
+                return false;
+            }
+        }
+        for (auto& worker : workers) {
+            worker->thread = std::thread(&EpollEngine::worker_loop, this, worker.get());
+        }
+        return true;
+    }
+    
+    // 所属I/O线程上直接非阻塞写，socket写满时把剩余数据挂在连接上等EPOLLOUT；
+    // 其他线程只追加到连接的发送缓冲区，再唤醒所属线程去写
+    void send(const std::shared_ptr<Connection>& conn, const std::string& message) override {
+        Worker* worker = static_cast<Worker*>(conn->owner);
+        {
+            std::lock_guard<std::mutex> lock(conn->send_mutex);
+            if (conn->closed || conn->overflowed) {
+                return;
+            }
+            
+            size_t offset = 0;
+            if (worker == current_worker && conn->pending_out.empty()) {
+                while (offset < message.size()) {
+                    ssize_t sent = ::send(conn->fd, message.data() + offset, message.size() - offset, MSG_NOSIGNAL);
+                    if (sent > 0) {
+                        offset += sent;
+                    } else if (sent < 0 && errno == EINTR) {
+                        continue;
+                    } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        break;
+                    } else {
+                        return; // 连接已出错，由读事件负责关闭
+                    }
+                }
+                if (offset == message.size()) {
+                    return;
+                }
+            }
+            if (!reserve_outbound(*conn, message.size() - offset)) {
+                return;
+            }
+            conn->pending_out.append(message, offset, std::string::npos);
+            account_outbound(*conn);
+            // 所属线程上的剩余数据等EPOLLOUT
+            if (worker == current_worker || conn->flush_queued) {
+                return;
+            }
+            conn->flush_queued = true;
+        }
+        queue_flush(worker, conn);
+    }
     
-    Json::StreamWriterBuilder writer;
-    return Json::writeString(writer, root);
-}
-
-std::string create_data_response(const std::string& device_id) {
-    std::lock_guard<std::mutex> lock(data_mutex);
-    if (device_data_map.find(device_id) == device_data_map.end()) {
-        return create_ack(device_id, "device_not_found");
+    void publish(const std::shared_ptr<Connection>& conn, std::string_view device_id,
+                 const std::shared_ptr<const RenderedResponse>& response) override {
+        {
+            std::lock_guard<std::mutex> lock(conn->send_mutex);
+            if (conn->closed || conn->overflowed) {
+                return;
+            }
+            // 有积压说明刷新已在途，合并后由它一并发出
+            if (!conn->pending_out.empty()) {
+                conflate_update(*conn, device_id, response);
+                return;
+            }
+        }
+        send(conn, response->frame_for(*conn));
     }
     
-    const auto& data = device_data_map[device_id];
+    void stop() override {
+        for (auto& worker : workers) {
+            uint64_t one = 1;
+            ssize_t ignored = write(worker->wake_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+        for (auto& worker : workers) {
+            worker->thread.join();
+        }
+        close_workers();
+    }
     
-    Json::Value root;
-    root["command"] = "data_response";
-    root["device_id"] = device_id;
+private:
+    void close_workers() {
+        for (auto& worker : workers) {
+            for (const auto& entry : worker->connections) {
+                release_connection(entry.second);
+            }
+            worker->connections.clear();
+            if (worker->listen_fd >= 0) {
+                close(worker->listen_fd);
+            }
+            if (worker->mqtt_listen_fd >= 0) {
+                close(worker->mqtt_listen_fd);
+            }
+            if (worker->wake_fd >= 0) {
+                close(worker->wake_fd);
+            }
+            if (worker->epoll_fd >= 0) {
+                close(worker->epoll_fd);
+            }
+        }
+        workers.clear();
+    }
     
-    Json::Value data_obj;
-    data_obj["temperature"] = data.temperature;
-    data_obj["soil_moisture"] = data.soil_moisture;
-    data_obj["temp_threshold"] = data.temp_threshold;
-    data_obj["moisture_threshold"] = data.moisture_threshold;
-    data_obj["watering"] = data.watering;
+    void queue_flush(Worker* worker, const std::shared_ptr<Connection>& conn) {
+        {
+            std::lock_guard<std::mutex> lock(worker->flush_mutex);
+            worker->flush_list.push_back(conn);
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(worker->wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
     
-    root["data"] = data_obj;
+    void flush_queued_sends(Worker* worker) {
+        std::vector<std::shared_ptr<Connection>> batch;
+        {
+            std::lock_guard<std::mutex> lock(worker->flush_mutex);
+            batch.swap(worker->flush_list);
+        }
+        for (const auto& conn : batch) {
+            flush_pending(*conn);
+        }
+    }
     
-    Json::StreamWriterBuilder writer;
-    return Json::writeString(writer, root);
-}
-
-std::string create_update_threshold(const std::string& device_id, double temp_threshold, double moisture_threshold) {
-    Json::Value root;
-    root["command"] = "update_threshold";
-    root["device_id"] = device_id;
-    root["temp_threshold"] = temp_threshold;
-    root["moisture_threshold"] = moisture_threshold;
+    // 写出待发数据，写空后接着写积压期间合并的推送
+    void flush_pending(Connection& conn) {
+        std::lock_guard<std::mutex> lock(conn.send_mutex);
+        conn.flush_queued = false;
+        size_t offset = 0;
+        while (!conn.closed) {
+            if (offset == conn.pending_out.size()) {
+                if (conn.conflated.empty()) {
+                    break;
+                }
+                conn.pending_out.clear();
+                offset = 0;
+                append_conflated(conn);
+            }
+            ssize_t sent = ::send(conn.fd, conn.pending_out.data() + offset, conn.pending_out.size() - offset, MSG_NOSIGNAL);
+            if (sent > 0) {
+                offset += sent;
+            } else if (sent < 0 && errno == EINTR) {
+                continue;
+            } else {
+                break;
+            }
+        }
+        conn.pending_out.erase(0, offset);
+        account_outbound(conn);
+    }
     
-    Json::StreamWriterBuilder writer;
-    return Json::writeString(writer, root);
-}
-
-void broadcast_to_pc_clients(const std::string& device_id, const std::string& message) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    for (const auto& client : connected_clients) {
-        if (client.second.second == CLIENT_PC) {
-            send(client.first, message.c_str(), message.size(), 0);
+    void close_connection(Worker* worker, const std::shared_ptr<Connection>& conn) {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+        worker->connections.erase(conn->fd);
+        release_connection(conn);
+    }
+    
+    void worker_loop(Worker* worker) {
+        epoll_event events[MAX_EVENTS];
+        char buffer[BUFFER_SIZE];
+        current_worker = worker;
+        pin_current_thread(worker->cpu);
+        
+        while (server_running) {
+            int ready = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, 500);
+            if (ready < 0 && errno != EINTR) {
+                LOG(LOG_ERROR) << "epoll_wait failed";
+                break;
+            }
+            
+            for (int i = 0; i < ready; ++i) {
+                if (events[i].data.ptr == nullptr) {
+                    accept_connections(worker, worker->listen_fd, FRAME_UNKNOWN);
+                    continue;
+                }
+                if (events[i].data.ptr == &worker->mqtt_listen_fd) {
+                    accept_connections(worker, worker->mqtt_listen_fd, FRAME_MQTT);
+                    continue;
+                }
+                if (events[i].data.ptr == worker) {
+                    uint64_t value;
+                    ssize_t ignored = read(worker->wake_fd, &value, sizeof(value));
+                    (void)ignored;
+                    continue;
+                }
+                
+                std::shared_ptr<Connection> conn = static_cast<Connection*>(events[i].data.ptr)->shared_from_this();
+                bool closing = events[i].events & (EPOLLHUP | EPOLLERR);
+                
+                if (events[i].events & EPOLLOUT) {
+                    flush_pending(*conn);
+                }
+                
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                    // 边沿触发：必须一直读到EAGAIN。有半帧时直接读进连接缓冲区续上
+                    while (true) {
+                        bool partial = !conn->inbuf.empty();
+                        if (partial) {
+                            conn->inbuf.reserve(BUFFER_SIZE);
+                        }
+                        char* dest = partial ? conn->inbuf.write_ptr() : buffer;
+                        size_t room = partial ? conn->inbuf.writable() : sizeof(buffer);
+                        
+                        ssize_t valread = read(conn->fd, dest, room);
+                        if (valread > 0) {
+                            bool ok;
+                            if (partial) {
+                                conn->inbuf.commit(valread);
+                                ok = process_recv_buffer(conn);
+                            } else {
+                                ok = process_received(conn, buffer, valread);
+                            }
+                            if (!ok) {
+                                LOG(LOG_WARN) << "Invalid frame, closing connection";
+                                closing = true;
+                                break;
+                            }
+                        } else if (valread < 0 && errno == EINTR) {
+                            continue;
+                        } else if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                            break;
+                        } else {
+                            LOG(LOG_WARN) << "Client disconnected or error reading";
+                            closing = true;
+                            break;
+                        }
+                    }
+                }
+                
+                if (closing) {
+                    close_connection(worker, conn);
+                }
+            }
+            flush_queued_sends(worker);
         }
     }
-}
+    
+    // mode为新连接的分帧方式，MQTT端口上的连接一开始就确定
+    void accept_connections(Worker* worker, int listen_fd, uint8_t mode) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        
+        // 边沿触发：一直accept到EAGAIN
+        while (true) {
+            int new_socket = accept4(listen_fd, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (new_socket < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG(LOG_ERROR) << "Accept failed";
+                }
+                return;
+            }
+            
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &address.sin_addr, client_ip, INET_ADDRSTRLEN);
+            LOG(LOG_INFO) << "New connection from " << client_ip << ":" << ntohs(address.sin_port);
+            
+            auto conn = std::make_shared<Connection>(new_socket);
+            conn->owner = worker;
+            conn->framer.mode = mode;
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = conn.get();
+            if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, new_socket, &ev) < 0) {
+                LOG(LOG_ERROR) << "epoll_ctl failed";
+                close(new_socket);
+                continue;
+            }
+            worker->connections[new_socket] = conn;
+        }
+    }
+    
+    std::vector<std::unique_ptr<Worker>> workers;
+};
 
-void handle_client(int client_socket) {
-    char buffer[BUFFER_SIZE] = {0};
+// 直接基于系统调用的最小io_uring封装（不依赖liburing）
+class Uring {
+public:
+    ~Uring() {
+        if (buf_ring) {
+            munmap(buf_ring, buf_count * sizeof(io_uring_buf));
+        }
+        delete[] buf_base;
+        if (sqes) {
+            munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+        }
+        if (cq_ptr && cq_ptr != sq_ptr) {
+            munmap(cq_ptr, cq_size);
+        }
+        if (sq_ptr) {
+            munmap(sq_ptr, sq_size);
+        }
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+    }
     
-    while (server_running) {
-        int valread = read(client_socket, buffer, BUFFER_SIZE - 1);
+    bool init(unsigned entries) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) {
+            return false;
+        }
         
-        if (valread <= 0) {
-            std::cerr << "Client disconnected or error reading" << std::endl;
-            break;
+        sq_entries = params.sq_entries;
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_size = cq_size = std::max(sq_size, cq_size);
         }
         
-        buffer[valread] = '\0';
-        std::cout << "Received message: " << buffer << std::endl;
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            sq_ptr = nullptr;
+            return false;
+        }
+        cq_ptr = single_mmap ? sq_ptr : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            cq_ptr = nullptr;
+            return false;
+        }
+        void* sqe_mem = mmap(nullptr, sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqe_mem == MAP_FAILED) {
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe*>(sqe_mem);
         
-        Json::Value root;
-        Json::CharReaderBuilder reader;
-        std::string errors;
-        std::istringstream iss(buffer);
+        char* sq = static_cast<char*>(sq_ptr);
+        char* cq = static_cast<char*>(cq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
         
-        if (!Json::parseFromStream(reader, iss, &root, &errors)) {
-            std::cerr << "Failed to parse JSON: " << errors << std::endl;
-            continue;
+        // SQ索引数组固定为恒等映射，之后只需推进tail
+        unsigned* sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; ++i) {
+            sq_array[i] = i;
         }
+        sqe_tail = submitted_tail = *sq_tail;
+        return true;
+    }
+    
+    // 注册一组由内核挑选的接收缓冲区（provided buffer ring）
+    bool setup_buffer_ring(unsigned short group, unsigned count, unsigned buffer_size) {
+        void* ring_mem = mmap(nullptr, count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring_mem == MAP_FAILED) {
+            return false;
+        }
+        // C++下头文件里的柔性数组前多了一个空结构体，bufs偏移不对，
+        // 这里直接按io_uring_buf数组访问，tail与bufs[0].resv重叠
+        buf_ring = static_cast<io_uring_buf*>(ring_mem);
+        buf_count = count;
+        buf_size = buffer_size;
         
-        std::string command = root["command"].asString();
-        std::string device_id = root["device_id"].asString();
-        std::string response;
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            return false;
+        }
         
-        if (command == "upload") {
-            // STM32上传数据
-            {
-                std::lock_guard<std::mutex> lock(data_mutex);
-                DeviceData data;
-                Json::Value data_obj = root["data"];
-                data.temperature = data_obj["temperature"].asDouble();
-                data.soil_moisture = data_obj["soil_moisture"].asDouble();
-                data.temp_threshold = data_obj["temp_threshold"].asDouble();
-                data.moisture_threshold = data_obj["moisture_threshold"].asDouble();
-                data.watering = data_obj["watering"].asBool();
-                
-                device_data_map[device_id] = data;
+        buf_base = new char[(size_t)count * buffer_size];
+        for (unsigned i = 0; i < count; ++i) {
+            recycle_buffer(i);
+        }
+        return true;
+    }
+    
+    char* buffer(unsigned short bid) { return buf_base + (size_t)bid * buf_size; }
+    
+    void recycle_buffer(unsigned short bid) {
+        io_uring_buf* buf = &buf_ring[buf_tail & (buf_count - 1)];
+        buf->addr = reinterpret_cast<uint64_t>(buffer(bid));
+        buf->len = buf_size;
+        buf->bid = bid;
+        ++buf_tail;
+        __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+    }
+    
+    io_uring_sqe* get_sqe() {
+        while (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            submit(0);
+        }
+        io_uring_sqe* sqe = &sqes[sqe_tail & sq_mask];
+        ++sqe_tail;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+    
+    // 一次系统调用提交所有已准备的SQE，并可选地等待完成事件
+    int submit(unsigned wait_nr) {
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = sqe_tail - submitted_tail;
+        submitted_tail = sqe_tail;
+        unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+        int ret;
+        do {
+            ret = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, nullptr, 0);
+        } while (ret < 0 && errno == EINTR && to_submit > 0);
+        return ret;
+    }
+    
+    template <typename Handler>
+    void drain_cqes(Handler&& handle) {
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            handle(cqe);
+        }
+    }
+    
+    int ring_fd = -1;
+    
+private:
+    void* sq_ptr = nullptr;
+    void* cq_ptr = nullptr;
+    size_t sq_size = 0;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned cq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sqe_tail = 0;
+    unsigned submitted_tail = 0;
+    
+    io_uring_buf* buf_ring = nullptr;
+    char* buf_base = nullptr;
+    unsigned buf_count = 0;
+    unsigned buf_size = 0;
+    unsigned short buf_tail = 0;
+};
+
+// io_uring：multishot accept + 基于provided buffer ring的multishot recv，
+// 每轮循环把所有待发数据合并为一次io_uring_enter提交
+class UringEngine : public IoEngine {
+    enum : uint64_t { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_WAKE };
+    static constexpr unsigned short BUFFER_GROUP = 0;
+    
+    struct Worker {
+        Uring ring;
+        int listen_fd = -1;
+        int mqtt_listen_fd = -1;
+        int cpu = -1;
+        int wake_fd = -1;
+        uint64_t wake_value = 0;
+        std::unordered_map<uint64_t, std::shared_ptr<Connection>> connections;
+        std::mutex flush_mutex;
+        std::vector<std::shared_ptr<Connection>> flush_list;
+        std::thread thread;
+    };
+    
+    static uint64_t tag(uint64_t op, uint64_t id) { return (op << 56) | id; }
+    
+    inline static thread_local Worker* current_worker = nullptr;
+    
+public:
+    const char* name() const override { return "io_uring"; }
+    
+    bool start(int port, int mqtt_port, unsigned thread_count) override {
+        for (unsigned i = 0; i < thread_count; ++i) {
+            auto worker = std::make_unique<Worker>();
+            worker->cpu = worker_cpu(i);
+            worker->wake_fd = eventfd(0, EFD_CLOEXEC);
+            bool ok = worker->wake_fd >= 0 && worker->ring.init(URING_ENTRIES)
+                && worker->ring.setup_buffer_ring(BUFFER_GROUP, URING_BUFFER_COUNT, BUFFER_SIZE);
+            if (!ok) {
+                LOG(LOG_ERROR) << "io_uring setup failed: " << strerror(errno);
+            } else {
+                // io_uring的accept遇到非阻塞监听socket会直接返回EAGAIN，这里用阻塞模式
+                worker->listen_fd = create_listener(port, worker->cpu, false);
+                if (mqtt_port > 0) {
+                    worker->mqtt_listen_fd = create_listener(mqtt_port, worker->cpu, false);
+                }
+                ok = worker->listen_fd >= 0 && (mqtt_port <= 0 || worker->mqtt_listen_fd >= 0);
             }
-            
-            // 标记为STM32客户端
-            {
-                std::lock_guard<std::mutex> lock(clients_mutex);
-                connected_clients[client_socket] = {device_id, CLIENT_STM32};
+            workers.push_back(std::move(worker));
+            if (!ok) {
+                close_workers();
+                return false;
             }
-            
-            response = create_ack(device_id, "success");
-            std::cout << "Updated data for device: " << device_id << std::endl;
-            
-            // 广播给所有PC客户端
-            broadcast_to_pc_clients(device_id, create_data_response(device_id));
-        } else if (command == "get_data") {
-            // PC请求数据
-            {
-                std::lock_guard<std::mutex> lock(clients_mutex);
-                connected_clients[client_socket] = {device_id, CLIENT_PC};
-            }
-            response = create_data_response(device_id);
-            std::cout << "Responding to data request for device: " << device_id << std::endl;
-        } else if (command == "set_threshold") {
-            // PC设置阈值
-            double temp_threshold = root["temp_threshold"].asDouble();
-            double moisture_threshold = root["moisture_threshold"].asDouble();
-            
-            {
-                std::lock_guard<std::mutex> lock(data_mutex);
-                if (device_data_map.find(device_id) != device_data_map.end()) {
-                    device_data_map[device_id].temp_threshold = temp_threshold;
-                    device_data_map[device_id].moisture_threshold = moisture_threshold;
+        }
+        for (auto& worker : workers) {
+            worker->thread = std::thread(&UringEngine::worker_loop, this, worker.get());
+        }
+        return true;
+    }
+    
+    // 只追加到连接的发送缓冲区，真正的SEND由所属ring线程在下一轮批量提交
+    void send(const std::shared_ptr<Connection>& conn, const std::string& message) override {
+        {
+            std::lock_guard<std::mutex> lock(conn->send_mutex);
+            if (conn->closed || conn->overflowed || !reserve_outbound(*conn, message.size())) {
+                return;
+            }
+            conn->pending_out += message;
+            account_outbound(*conn);
+            if (conn->flush_queued) {
+                return;
+            }
+            conn->flush_queued = true;
+        }
+        
+        Worker* worker = static_cast<Worker*>(conn->owner);
+        {
+            std::lock_guard<std::mutex> lock(worker->flush_mutex);
+            worker->flush_list.push_back(conn);
+        }
+        if (worker != current_worker) {
+            uint64_t one = 1;
+            ssize_t ignored = write(worker->wake_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+    
+    void publish(const std::shared_ptr<Connection>& conn, std::string_view device_id,
+                 const std::shared_ptr<const RenderedResponse>& response) override {
+        {
+            std::lock_guard<std::mutex> lock(conn->send_mutex);
+            if (conn->closed || conn->overflowed) {
+                return;
+            }
+            // SEND在途或已有待发数据时合并，由下一次take_pending一并取走
+            if (conn->send_inflight || !conn->pending_out.empty()) {
+                conflate_update(*conn, device_id, response);
+                return;
+            }
+        }
+        send(conn, response->frame_for(*conn));
+    }
+    
+    void stop() override {
+        for (auto& worker : workers) {
+            uint64_t one = 1;
+            ssize_t ignored = write(worker->wake_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+        for (auto& worker : workers) {
+            worker->thread.join();
+        }
+        close_workers();
+    }
+    
+private:
+    void close_workers() {
+        for (auto& worker : workers) {
+            for (const auto& entry : worker->connections) {
+                if (!entry.second->closed) {
+                    release_connection(entry.second);
                 }
             }
-            
-            // 查找对应的STM32客户端并发送更新
-            int stm32_socket = -1;
+            worker->connections.clear();
+            if (worker->listen_fd >= 0) {
+                close(worker->listen_fd);
+            }
+            if (worker->mqtt_listen_fd >= 0) {
+                close(worker->mqtt_listen_fd);
+            }
+            if (worker->wake_fd >= 0) {
+                close(worker->wake_fd);
+            }
+        }
+        workers.clear();
+    }
+    
+    // ACCEPT的id：0为主端口，1为MQTT端口
+    void arm_accept(Worker* worker, uint64_t listener) {
+        io_uring_sqe* sqe = worker->ring.get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listener == 0 ? worker->listen_fd : worker->mqtt_listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = tag(OP_ACCEPT, listener);
+    }
+    
+    void arm_wake(Worker* worker) {
+        io_uring_sqe* sqe = worker->ring.get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = worker->wake_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&worker->wake_value);
+        sqe->len = sizeof(worker->wake_value);
+        sqe->user_data = tag(OP_WAKE, 0);
+    }
+    
+    void arm_recv(Worker* worker, const Connection& conn) {
+        io_uring_sqe* sqe = worker->ring.get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn.fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = tag(OP_RECV, conn.id);
+    }
+    
+    void prep_send(Worker* worker, const Connection& conn) {
+        io_uring_sqe* sqe = worker->ring.get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(conn.sending.data() + conn.send_offset);
+        sqe->len = conn.sending.size() - conn.send_offset;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = tag(OP_SEND, conn.id);
+    }
+    
+    // 把待发数据和合并的推送移入在途缓冲区；已有SEND在途时等它完成后再续发
+    bool take_pending(Connection& conn) {
+        std::lock_guard<std::mutex> lock(conn.send_mutex);
+        if (!conn.closed) {
+            append_conflated(conn);
+        }
+        if (conn.closed || conn.pending_out.empty()) {
+            conn.send_inflight = false;
+            conn.sending.clear();
+            account_outbound(conn);
+            return false;
+        }
+        conn.sending.swap(conn.pending_out);
+        conn.pending_out.clear();
+        account_outbound(conn);
+        conn.send_offset = 0;
+        conn.send_inflight = true;
+        return true;
+    }
+    
+    void flush_queued_sends(Worker* worker) {
+        std::vector<std::shared_ptr<Connection>> batch;
+        {
+            std::lock_guard<std::mutex> lock(worker->flush_mutex);
+            batch.swap(worker->flush_list);
+        }
+        for (const auto& conn : batch) {
             {
-                std::lock_guard<std::mutex> lock(clients_mutex);
-                for (const auto& client : connected_clients) {
-                    if (client.second.first == device_id && client.second.second == CLIENT_STM32) {
-                        stm32_socket = client.first;
-                        break;
-                    }
+                std::lock_guard<std::mutex> lock(conn->send_mutex);
+                conn->flush_queued = false;
+                if (conn->send_inflight) {
+                    continue;
                 }
             }
-            
-            if (stm32_socket != -1) {
-                std::string update_msg = create_update_threshold(device_id, temp_threshold, moisture_threshold);
-                send(stm32_socket, update_msg.c_str(), update_msg.size(), 0);
-                std::cout << "Forwarding threshold update to STM32 for device: " << device_id << std::endl;
-            } else {
-                response = create_ack(device_id, "device_not_connected");
-                send(client_socket, response.c_str(), response.size(), 0);
-                std::cerr << "STM32 device not connected: " << device_id << std::endl;
-                continue;
-            }
-            
-            // 等待STM32的确认
-            char ack_buffer[BUFFER_SIZE] = {0};
-            int ack_read = read(stm32_socket, ack_buffer, BUFFER_SIZE - 1);
-            if (ack_read > 0) {
-                ack_buffer[ack_read] = '\0';
-                std::cout << "Received STM32 ACK: " << ack_buffer << std::endl;
-                response = create_ack(device_id, "success");
-            } else {
-                response = create_ack(device_id, "device_not_responded");
+            if (take_pending(*conn)) {
+                prep_send(worker, *conn);
             }
-        } else if (command == "ack" && root["status"].asString() == "success") {
-            // STM32确认阈值更新
-            continue; // 已经在上面的set_threshold处理中回复PC
-        } else {
-            response = create_ack(device_id, "unknown_command");
-            std::cerr << "Unknown command received: " << command << std::endl;
+        }
+    }
+    
+    void close_connection(Worker* worker, const std::shared_ptr<Connection>& conn) {
+        release_connection(conn);
+        // 仍有SEND在途时保留连接对象，等完成事件到达再释放缓冲区
+        if (!conn->send_inflight) {
+            worker->connections.erase(conn->id);
+        }
+    }
+    
+    void on_accept(Worker* worker, int new_socket, uint8_t mode) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        if (getpeername(new_socket, (struct sockaddr *)&address, &addrlen) == 0) {
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &address.sin_addr, client_ip, INET_ADDRSTRLEN);
+            LOG(LOG_INFO) << "New connection from " << client_ip << ":" << ntohs(address.sin_port);
         }
         
-        send(client_socket, response.c_str(), response.size(), 0);
-        std::cout << "Sent response: " << response << std::endl;
+        auto conn = std::make_shared<Connection>(new_socket);
+        conn->owner = worker;
+        conn->framer.mode = mode;
+        worker->connections[conn->id] = conn;
+        arm_recv(worker, *conn);
     }
     
-    // 客户端断开连接
-    {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        connected_clients.erase(client_socket);
+    void on_recv(Worker* worker, uint64_t id, const io_uring_cqe& cqe) {
+        bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+        unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        
+        auto it = worker->connections.find(id);
+        if (it == worker->connections.end()) {
+            if (has_buffer) {
+                worker->ring.recycle_buffer(bid);
+            }
+            return;
+        }
+        std::shared_ptr<Connection> conn = it->second;
+        
+        if (cqe.res > 0 && has_buffer && !process_received(conn, worker->ring.buffer(bid), cqe.res)) {
+            // 分帧出错：让multishot recv以EOF结束，统一走关闭流程
+            LOG(LOG_WARN) << "Invalid frame, closing connection";
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        if (has_buffer) {
+            worker->ring.recycle_buffer(bid);
+        }
+        
+        if (cqe.res == -ENOBUFS) {
+            // 缓冲区暂时耗尽，归还后重新挂接收
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                arm_recv(worker, *conn);
+            }
+            return;
+        }
+        if (cqe.res <= 0) {
+            LOG(LOG_WARN) << "Client disconnected or error reading";
+            close_connection(worker, conn);
+            return;
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            arm_recv(worker, *conn);
+        }
     }
-    close(client_socket);
-}
-
-void accept_connections(int server_fd) {
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
     
-    while (server_running) {
-        int new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
-        if (new_socket < 0) {
-            if (server_running) {
-                std::cerr << "Accept failed" << std::endl;
+    void on_send(Worker* worker, uint64_t id, int res) {
+        auto it = worker->connections.find(id);
+        if (it == worker->connections.end()) {
+            return;
+        }
+        std::shared_ptr<Connection> conn = it->second;
+        
+        if (res < 0 || conn->closed) {
+            bool closed;
+            {
+                std::lock_guard<std::mutex> lock(conn->send_mutex);
+                conn->send_inflight = false;
+                conn->sending.clear();
+                closed = conn->closed;
             }
-            continue;
+            if (closed) {
+                worker->connections.erase(id);
+            } else {
+                // 让multishot recv以EOF结束，统一走关闭流程
+                shutdown(conn->fd, SHUT_RDWR);
+            }
+            return;
         }
         
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &address.sin_addr, client_ip, INET_ADDRSTRLEN);
-        std::cout << "New connection from " << client_ip << ":" << ntohs(address.sin_port) << std::endl;
+        conn->send_offset += res;
+        if (conn->send_offset < conn->sending.size() || take_pending(*conn)) {
+            prep_send(worker, *conn);
+        }
+    }
+    
+    void worker_loop(Worker* worker) {
+        current_worker = worker;
+        pin_current_thread(worker->cpu);
+        arm_accept(worker, 0);
+        if (worker->mqtt_listen_fd >= 0) {
+            arm_accept(worker, 1);
+        }
+        arm_wake(worker);
         
-        std::thread client_thread(handle_client, new_socket);
-        client_thread.detach();
+        while (server_running) {
+            flush_queued_sends(worker);
+            if (worker->ring.submit(1) < 0 && errno != EINTR) {
+                LOG(LOG_ERROR) << "io_uring_enter failed: " << strerror(errno);
+                break;
+            }
+            
+            worker->ring.drain_cqes([&](const io_uring_cqe& cqe) {
+                uint64_t id = cqe.user_data & ((1ULL << 56) - 1);
+                switch (cqe.user_data >> 56) {
+                case OP_ACCEPT:
+                    if (cqe.res >= 0) {
+                        on_accept(worker, cqe.res, id == 0 ? FRAME_UNKNOWN : FRAME_MQTT);
+                    } else if (server_running) {
+                        LOG(LOG_ERROR) << "Accept failed";
+                    }
+                    if (!(cqe.flags & IORING_CQE_F_MORE) && server_running) {
+                        arm_accept(worker, id);
+                    }
+                    break;
+                case OP_WAKE:
+                    if (server_running) {
+                        arm_wake(worker);
+                    }
+                    break;
+                case OP_RECV:
+                    on_recv(worker, id, cqe);
+                    break;
+                case OP_SEND:
+                    on_send(worker, id, cqe.res);
+                    break;
+                }
+            });
+        }
     }
-}
+    
+    std::vector<std::unique_ptr<Worker>> workers;
+};
 
-int main() {
-    int server_fd;
-    struct sockaddr_in address;
-    int opt = 1;
+// bench.cpp整体包含本文件以测试内部函数，此时不编译main
+#ifndef GATEWAY_NO_MAIN
+int main(int argc, char* argv[]) {
+    std::string io_backend = "epoll";
+    std::string data_dir;
+    int metrics_port = 0;
+    int mqtt_port = 0;
     
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        std::cerr << "Socket creation error" << std::endl;
-        return -1;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--io=", 0) == 0) {
+            io_backend = arg.substr(5);
+        } else if (arg == "--io" && i + 1 < argc) {
+            io_backend = argv[++i];
+        } else if (arg.rfind("--data-dir=", 0) == 0) {
+            data_dir = arg.substr(11);
+        } else if (arg.rfind("--metrics-port=", 0) == 0) {
+            metrics_port = atoi(arg.c_str() + 15);
+        } else if (arg.rfind("--mqtt-port=", 0) == 0) {
+            mqtt_port = atoi(arg.c_str() + 12);
+        } else if (arg.rfind("--log-level=", 0) == 0) {
+            std::string level = arg.substr(12);
+            if (level == "debug") {
+                log_level = LOG_DEBUG;
+            } else if (level == "info") {
+                log_level = LOG_INFO;
+            } else if (level == "warn") {
+                log_level = LOG_WARN;
+            } else if (level == "error") {
+                log_level = LOG_ERROR;
+            } else {
+                std::cerr << "Unknown log level: " << level << std::endl;
+                return -1;
+            }
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--io=epoll|uring] [--data-dir=DIR] [--mqtt-port=PORT] [--metrics-port=PORT] [--log-level=debug|info|warn|error]" << std::endl;
+            return -1;
+        }
     }
     
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        std::cerr << "Setsockopt error" << std::endl;
-        return -1;
+    // 指定数据目录时先恢复设备表再开始接受连接
+    if (!data_dir.empty()) {
+        uint64_t generation;
+        if (!recover_device_state(data_dir, generation)
+            || !wal.start(data_dir, generation, [] { return device_store.snapshot(); })) {
+            return -1;
+        }
     }
     
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
-    
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        std::cerr << "Bind failed" << std::endl;
+    unsigned io_thread_count = std::max(1u, std::thread::hardware_concurrency());
+    if (io_backend == "uring") {
+        io_engine = std::make_unique<UringEngine>();
+        if (!io_engine->start(PORT, mqtt_port, io_thread_count)) {
+            LOG(LOG_WARN) << "io_uring unavailable, falling back to epoll";
+            io_engine.reset();
+        }
+    } else if (io_backend != "epoll") {
+        std::cerr << "Unknown I/O backend: " << io_backend << std::endl;
         return -1;
     }
+    if (!io_engine) {
+        io_engine = std::make_unique<EpollEngine>();
+        if (!io_engine->start(PORT, mqtt_port, io_thread_count)) {
+            return -1;
+        }
+    }
     
-    if (listen(server_fd, 10) < 0) {
-        std::cerr << "Listen failed" << std::endl;
-        return -1;
+    LOG(LOG_INFO) << "Server started on port " << PORT << " with " << io_thread_count << " " << io_engine->name() << " I/O threads (one listener each)";
+    LOG(LOG_INFO) << "JSON structural scanner: " << structural_scanner.name;
+    if (mqtt_port > 0) {
+        LOG(LOG_INFO) << "MQTT 3.1.1 listening on port " << mqtt_port;
     }
     
-    std::cout << "Server started on port " << PORT << std::endl;
+    std::thread command_timer(command_timeout_loop);
     
-    std::thread accept_thread(accept_connections, server_fd);
+    std::thread metrics_thread;
+    if (metrics_port > 0) {
+        int metrics_fd = create_listener(metrics_port, -1, false);
+        if (metrics_fd < 0) {
+            LOG(LOG_WARN) << "Metrics endpoint disabled: cannot listen on port " << metrics_port;
+        } else {
+            metrics_thread = std::thread(metrics_loop, metrics_fd);
+            LOG(LOG_INFO) << "Serving Prometheus metrics on port " << metrics_port << " at /metrics";
+        }
+    }
     
     // 简单的控制台命令处理
     std::string command;
     while (std::cin >> command) {
         if (command == "quit") {
             server_running = false;
-            // 关闭所有客户端连接
-            {
-                std::lock_guard<std::mutex> lock(clients_mutex);
-                for (const auto& client : connected_clients) {
-                    close(client.first);
-                }
-                connected_clients.clear();
-            }
-            // 关闭服务器socket
-            close(server_fd);
             break;
         } else if (command == "clients") {
             std::lock_guard<std::mutex> lock(clients_mutex);
             std::cout << "Connected clients (" << connected_clients.size() << "):" << std::endl;
             for (const auto& client : connected_clients) {
-                std::cout << "Socket: " << client.first 
-                          << ", Device ID: " << client.second.first 
-                          << ", Type: " << (client.second.second == CLIENT_STM32 ? "STM32" : "PC") 
+                std::cout << "Socket: " << client.first
+                          << ", Device ID: " << client.second->device_id
+                          << ", Type: " << (client.second->type == CLIENT_STM32 ? "STM32" : "PC")
                           << std::endl;
             }
         } else if (command == "devices") {
-            std::lock_guard<std::mutex> lock(data_mutex);
-            std::cout << "Registered devices (" << device_data_map.size() << "):" << std::endl;
-            for (const auto& device : device_data_map) {
+            auto devices = device_store.snapshot();
+            std::cout << "Registered devices (" << devices.size() << "):" << std::endl;
+            for (const auto& device : devices) {
                 std::cout << "Device ID: " << device.first 
                           << ", Temp: " << device.second.temperature
                           << ", Moisture: " << device.second.soil_moisture
                           << std::endl;
             }
+        } else if (command == "history") {
+            size_t samples, bytes;
+            device_store.history_stats(samples, bytes);
+            std::cout << "History: " << samples << " samples, " << bytes << " bytes";
+            if (samples > 0) {
+                std::cout << " (" << (double)bytes / samples << " bytes/sample)";
+            }
+            std::cout << std::endl;
+        } else if (command == "stats") {
+            print_command_stats(std::cout);
+        } else if (command == "stats_json") {
+            std::cout << command_stats_json() << std::endl;
         } else {
-            std::cout << "Unknown command. Available commands: quit, clients, devices" << std::endl;
+            std::cout << "Unknown command. Available commands: quit, clients, devices, history, stats, stats_json" << std::endl;
         }
     }
     
-    accept_thread.join();
+    // 控制台输入结束（如stdin为/dev/null的后台运行）时继续服务，只有quit才退出
+    if (server_running) {
+        LOG(LOG_INFO) << "Console input closed, serving until the process is stopped";
+        while (server_running) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }
+    
+    // 关闭所有客户端连接
+    command_timer.join();
+    if (metrics_thread.joinable()) {
+        metrics_thread.join();
+    }
+    io_engine->stop();
+    wal.stop();
     return 0;
 }
+#endif